@@ -5,9 +5,27 @@
 #include <fstream>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
 #include <algorithm>
 #include <limits>
 #include <chrono>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <cstring>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -41,6 +59,16 @@ struct Color {
     float brightness() const { return (r + g + b) / (3.0f * 255.0f); }
 };
 
+// Unclamped linear color for shading and accumulation; 1.0 is 8-bit full scale (255)
+struct ColorF {
+    float r, g, b;
+    ColorF() : r(0), g(0), b(0) {}
+    ColorF(float rr, float gg, float bb) : r(rr), g(gg), b(bb) {}
+    explicit ColorF(const Color& c) : r(c.r / 255.0f), g(c.g / 255.0f), b(c.b / 255.0f) {}
+    ColorF operator*(float s) const { return ColorF(r * s, g * s, b * s); }
+    ColorF operator+(const ColorF& o) const { return ColorF(r + o.r, g + o.g, b + o.b); }
+};
+
 struct Vec3f {
     float x, y, z;
     Vec3f() : x(0), y(0), z(0) {}
@@ -50,6 +78,7 @@ struct Vec3f {
     Vec3f operator*(float s) const { return {x*s, y*s, z*s}; }
     Vec3f operator/(float s) const { return {x/s, y/s, z/s}; }
     Vec3f operator-() const { return {-x, -y, -z}; }
+    float operator[](int i) const { return (&x)[i]; }
     float length() const { return sqrtf(x*x + y*y + z*z); }
 };
 float dot(const Vec3f& a, const Vec3f& b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
@@ -70,6 +99,7 @@ struct Image {
     int W, H;
     vector<Color> pix;
     explicit Image(int w, int h, Color bg = Color(80,90,110)) : W(w), H(h), pix(w*h, bg) {}
+    // Plain store, no locking: tiled renders write disjoint pixels from each thread
     void PutPixel(int x, int y, Color c) {
         if (x < 0 || x >= W || y < 0 || y >= H) return;
         pix[y * W + x] = c;
@@ -82,6 +112,50 @@ struct Image {
     }
 };
 
+// ---------------------- HDR accumulation ----------------------
+enum class ToneMap { Clamp, Reinhard };
+
+// Float RGB sums in planar (SoA) layout so the resolve loop vectorizes. Each pass adds one sample
+// per pixel; tiles write disjoint pixels, so no locking. Quantization to 8 bits happens once, in
+// resolve(), fused with the tone map.
+struct HDRBuffer {
+    int W, H;
+    int passes = 0; // completed passes; call endPass() after each full-frame pass
+    vector<float> r, g, b;
+    HDRBuffer(int w, int h) : W(w), H(h), r(size_t(w) * h, 0.0f), g(size_t(w) * h, 0.0f), b(size_t(w) * h, 0.0f) {}
+
+    void add(int x, int y, const ColorF& c) {
+        size_t i = size_t(y) * W + x;
+        r[i] += c.r;
+        g[i] += c.g;
+        b[i] += c.b;
+    }
+    void endPass() { ++passes; }
+
+    // Average of the accumulated passes, tone mapped and encoded to 8 bits
+    Image resolve(ToneMap toneMap = ToneMap::Clamp) const {
+        Image img(W, H);
+        const size_t n = size_t(W) * H;
+        const float inv = passes > 0 ? 1.0f / passes : 1.0f;
+        vector<float> enc(3 * n);
+        float* er = enc.data();
+        float* eg = er + n;
+        float* eb = eg + n;
+        for (int c = 0; c < 3; ++c) {
+            const float* src = c == 0 ? r.data() : c == 1 ? g.data() : b.data();
+            float* dst = c == 0 ? er : c == 1 ? eg : eb;
+            if (toneMap == ToneMap::Reinhard) {
+                for (size_t i = 0; i < n; ++i) { float v = src[i] * inv; dst[i] = v / (1.0f + v) * 255.0f + 0.5f; }
+            } else {
+                for (size_t i = 0; i < n; ++i) dst[i] = min(max(src[i] * inv, 0.0f), 1.0f) * 255.0f + 0.5f;
+            }
+        }
+        for (size_t i = 0; i < n; ++i)
+            img.pix[i] = Color(uint8_t(er[i]), uint8_t(eg[i]), uint8_t(eb[i]));
+        return img;
+    }
+};
+
 // ---------------------- Ray / Scene objects ----------------------
 struct Ray {
     Vec3f origin, direction;
@@ -89,16 +163,139 @@ struct Ray {
     Vec3f pointAt(float t) const { return origin + direction * t; }
 };
 
+// ---------------------- Shadow occluder cache ----------------------
+// Per light, the primitive that last blocked a shadow ray in the current tile. Neighbouring
+// pixels usually share an occluder, so testing it first answers most shadowed queries with a
+// single intersection. Create one per tile: it is then private to the worker rendering it.
+// The same per-tile object carries the tile's shadow culling lists (Scene::beginTileCull).
+struct ShadowCacheStats {
+    long long queries = 0; // shadow rays that went through the cache
+    long long probes = 0;  // queries that had a cached occluder to try
+    long long hits = 0;    // probes where the cached occluder still blocked the ray
+    long long blocked = 0; // queries that ended up shadowed, by the cache or the full query
+    long long cullPairs = 0;  // tile/light pairs given an occluder list
+    long long emptyPairs = 0; // ...with nothing that could block them
+    long long culledRays = 0; // queries answered lit from an empty list, nothing traced
+    long long listedRays = 0; // queries tested against a short list instead of the whole scene
+    long long listTests = 0;  // primitives tested for those
+    void add(const ShadowCacheStats& o) {
+        queries += o.queries; probes += o.probes; hits += o.hits; blocked += o.blocked;
+        cullPairs += o.cullPairs; emptyPairs += o.emptyPairs;
+        culledRays += o.culledRays; listedRays += o.listedRays; listTests += o.listTests;
+    }
+    // Fraction of shadowed queries answered by the cached occluder alone
+    double hitRate() const { return blocked ? double(hits) / blocked : 0.0; }
+};
+
+struct ShadowCache {
+    vector<int> lastOccluder; // primID per light, -1 if none yet
+    ShadowCacheStats stats;
+    bool reuseOccluder = true; // try lastOccluder first (off: --no-shadow-cache with --tile-cull)
+    bool tileCull = false;     // --tile-cull: tracers call Scene::beginTileCull after their primary hits
+    // Culling state for the current tile: segments from inside [cullLo, cullHi] to light li can only
+    // be blocked by occluders[lists[li].first, + second); first < 0 until the list is built
+    bool culling = false;
+    Vec3f cullLo, cullHi;
+    vector<pair<int, int>> lists;
+    vector<int> occluders;
+    explicit ShadowCache(size_t numLights) : lastOccluder(numLights, -1) {}
+};
+
+// ---------------------- Bounding volumes ----------------------
+struct AABB {
+    Vec3f lo, hi;
+    AABB() : lo(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max()),
+             hi(-numeric_limits<float>::max(), -numeric_limits<float>::max(), -numeric_limits<float>::max()) {}
+    AABB(const Vec3f& l, const Vec3f& h) : lo(l), hi(h) {}
+    void expand(const Vec3f& p) {
+        lo = Vec3f(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+        hi = Vec3f(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+    void expand(const AABB& b) { expand(b.lo); expand(b.hi); }
+    Vec3f centroid() const { return (lo + hi) * 0.5f; }
+    float surfaceArea() const {
+        Vec3f d = hi - lo;
+        if (d.x < 0 || d.y < 0 || d.z < 0) return 0.0f;
+        return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+    // Slab test against [tMin, tMax]; tNear receives the entry distance
+    bool intersect(const Vec3f& orig, const Vec3f& invDir, float tMin, float tMax, float& tNear) const {
+        float tFar;
+        return intersect(orig, invDir, tMin, tMax, tNear, tFar);
+    }
+    // Same test, also reporting the exit distance
+    bool intersect(const Vec3f& orig, const Vec3f& invDir, float tMin, float tMax, float& tNear, float& tFar) const {
+        for (int a = 0; a < 3; ++a) {
+            float t0 = (lo[a] - orig[a]) * invDir[a];
+            float t1 = (hi[a] - orig[a]) * invDir[a];
+            if (t0 > t1) swap(t0, t1);
+            tMin = max(tMin, t0);
+            tMax = min(tMax, t1);
+            if (tMax < tMin) return false;
+        }
+        tNear = tMin;
+        tFar = tMax;
+        return true;
+    }
+};
+
+// Convex hull of two spheres (a, ra) and (b, rb): every segment between them lies inside
+struct RoundCone {
+    Vec3f a, b;
+    float ra, rb;
+    RoundCone(const Vec3f& a_, float ra_, const Vec3f& b_, float rb_) : a(a_), b(b_), ra(ra_), rb(rb_) {}
+
+    // Distance from p to the surface, negative inside (after Quilez's round-cone distance)
+    float distance(const Vec3f& p) const {
+        Vec3f ba = b - a;
+        float l2 = dot(ba, ba);
+        float rr = ra - rb;
+        float a2 = l2 - rr * rr;
+        if (a2 <= 0.0f) return ra >= rb ? (p - a).length() - ra : (p - b).length() - rb; // one sphere holds the other
+        Vec3f pa = p - a;
+        float y = dot(pa, ba);
+        float z = y - l2;
+        Vec3f q = pa * l2 - ba * y;
+        float x2 = dot(q, q);
+        float y2 = y * y * l2;
+        float z2 = z * z * l2;
+        float k = copysignf(1.0f, rr) * rr * rr * x2;
+        if (copysignf(1.0f, z) * a2 * z2 > k) return sqrtf(x2 + z2) / l2 - rb;
+        if (copysignf(1.0f, y) * a2 * y2 < k) return sqrtf(x2 + y2) / l2 - ra;
+        return (sqrtf(x2 * a2 / l2) + y * rr) / l2 - ra;
+    }
+    bool overlaps(const Vec3f& center, float radius) const { return distance(center) <= radius; }
+    // Conservative, through the box's bounding sphere
+    bool overlaps(const AABB& box) const { return overlaps(box.centroid(), (box.hi - box.lo).length() * 0.5f); }
+};
+
+// Reciprocal direction for slab tests; zero components become huge instead of inf/NaN
+Vec3f SafeInverse(const Vec3f& d) {
+    auto inv = [](float v) { return 1.0f / (fabs(v) > 1e-12f ? v : copysignf(1e-12f, v)); };
+    return Vec3f(inv(d.x), inv(d.y), inv(d.z));
+}
+
 struct Material {
     Color color;
     float ambient, diffuse, specular, shininess;
-    Material() : color(255,255,255), ambient(0.1f), diffuse(0.9f), specular(0.3f), shininess(32.0f) {}
-    Material(const Color& c, float a, float d, float s, float sh) : color(c), ambient(a), diffuse(d), specular(s), shininess(sh) {}
+    float reflectivity; // mirror reflection weight
+    float transparency; // refraction weight, split with reflection by Fresnel (Schlick)
+    float ior;          // index of refraction for transparent materials
+    Material() : color(255,255,255), ambient(0.1f), diffuse(0.9f), specular(0.3f), shininess(32.0f),
+                 reflectivity(0.0f), transparency(0.0f), ior(1.5f) {}
+    Material(const Color& c, float a, float d, float s, float sh, float refl = 0.0f, float transp = 0.0f, float eta = 1.5f)
+        : color(c), ambient(a), diffuse(d), specular(s), shininess(sh), reflectivity(refl), transparency(transp), ior(eta) {}
+    bool hasSecondary() const { return reflectivity > 0.0f || transparency > 0.0f; }
+    // Weight left for the local (ambient + lights) shading
+    float localWeight() const { return max(0.0f, 1.0f - reflectivity - transparency); }
 };
 
+// Index into Scene::materials; primitives and hit records carry this instead of a Material copy
+using MaterialID = uint16_t;
+
 struct Sphere {
-    Vec3f center; float radius; Material material;
-    Sphere(const Vec3f& c, float r, const Material& m) : center(c), radius(r), material(m) {}
+    Vec3f center; float radius; MaterialID material;
+    Sphere(const Vec3f& c, float r, MaterialID m) : center(c), radius(r), material(m) {}
     bool intersect(const Ray& ray, float& t) const {
         Vec3f oc = ray.origin - center;
         float a = dot(ray.direction, ray.direction);
@@ -113,11 +310,15 @@ struct Sphere {
         return t > 0.001f;
     }
     Vec3f normalAt(const Vec3f& pt) const { return normalize(pt - center); }
+    AABB bounds() const {
+        Vec3f e(radius, radius, radius);
+        return AABB(center - e, center + e);
+    }
 };
 
 struct Plane {
-    Vec3f point; Vec3f normal; Material material;
-    Plane(const Vec3f& p, const Vec3f& n, const Material& m) : point(p), normal(normalize(n)), material(m) {}
+    Vec3f point; Vec3f normal; MaterialID material;
+    Plane(const Vec3f& p, const Vec3f& n, MaterialID m) : point(p), normal(normalize(n)), material(m) {}
     bool intersect(const Ray& ray, float& t) const {
         float denom = dot(normal, ray.direction);
         if (fabs(denom) > 1e-6f) {
@@ -129,221 +330,4196 @@ struct Plane {
     }
 };
 
+enum class ShapeKind : uint8_t { Quad, Box, Disk };
+
+// Bounded primitives (build them with QuadShape, BoxShape and DiskShape). Unlike a Plane each has
+// a finite AABB, so Scene keeps them in a BVH and rays that pass nowhere near them never test them.
+// Quads and disks are two-sided; a box counts as solid, so rays starting inside hit its far side.
+struct Shape {
+    ShapeKind kind = ShapeKind::Quad;
+    Vec3f center;
+    Vec3f normal;       // Quad, Disk: unit normal
+    Vec3f edgeU, edgeV; // Quad: full edge vectors, centered on center (as for rect lights)
+    Vec3f axisU, axisV; // Quad: dot(p - center, axisU) is p's coordinate along edgeU, in [-0.5, 0.5] inside
+    Vec3f halfSize;     // Box: half extents along x, y and z
+    float radius = 0.0f; // Disk
+    MaterialID material = 0;
+
+    bool intersect(const Ray& ray, float& t) const {
+        if (kind == ShapeKind::Box) {
+            float tNear, tFar;
+            AABB box(center - halfSize, center + halfSize);
+            if (!box.intersect(ray.origin, SafeInverse(ray.direction), -numeric_limits<float>::max(), numeric_limits<float>::max(), tNear, tFar))
+                return false;
+            t = (tNear > 0.001f) ? tNear : tFar;
+            return t > 0.001f;
+        }
+        // Plane test as in Plane::intersect, then the in-shape test on the hit point
+        float denom = dot(normal, ray.direction);
+        if (fabs(denom) <= 1e-6f) return false;
+        t = dot(center - ray.origin, normal) / denom;
+        if (t < 0.001f) return false;
+        Vec3f q = ray.pointAt(t) - center;
+        if (kind == ShapeKind::Disk) return dot(q, q) <= radius * radius;
+        return fabsf(dot(q, axisU)) <= 0.5f && fabsf(dot(q, axisV)) <= 0.5f;
+    }
+    // Box: outward normal of the face p lies on (the axis where p is relatively furthest out)
+    Vec3f normalAt(const Vec3f& p) const {
+        if (kind != ShapeKind::Box) return normal;
+        Vec3f d = p - center;
+        float rx = fabsf(d.x) / halfSize.x, ry = fabsf(d.y) / halfSize.y, rz = fabsf(d.z) / halfSize.z;
+        if (rx >= ry && rx >= rz) return Vec3f(d.x >= 0 ? 1.0f : -1.0f, 0, 0);
+        if (ry >= rz) return Vec3f(0, d.y >= 0 ? 1.0f : -1.0f, 0);
+        return Vec3f(0, 0, d.z >= 0 ? 1.0f : -1.0f);
+    }
+    // Padded a little so flat shapes still have a box the slab test can hit
+    AABB bounds() const {
+        const float kPad = 1e-4f;
+        Vec3f e = halfSize;
+        if (kind == ShapeKind::Quad) {
+            e = Vec3f(fabsf(edgeU.x) + fabsf(edgeV.x), fabsf(edgeU.y) + fabsf(edgeV.y), fabsf(edgeU.z) + fabsf(edgeV.z)) * 0.5f;
+        } else if (kind == ShapeKind::Disk) {
+            e = Vec3f(sqrtf(max(0.0f, 1.0f - normal.x * normal.x)), sqrtf(max(0.0f, 1.0f - normal.y * normal.y)),
+                      sqrtf(max(0.0f, 1.0f - normal.z * normal.z))) * radius;
+        }
+        e = e + Vec3f(kPad, kPad, kPad);
+        return AABB(center - e, center + e);
+    }
+};
+
+// Parallelogram centered on center with full edges edgeU and edgeV, facing cross(edgeU, edgeV)
+Shape QuadShape(const Vec3f& center, const Vec3f& edgeU, const Vec3f& edgeV, MaterialID m) {
+    Shape s;
+    s.kind = ShapeKind::Quad;
+    s.center = center;
+    s.edgeU = edgeU;
+    s.edgeV = edgeV;
+    s.normal = normalize(cross(edgeU, edgeV));
+    // Dual axes: each is perpendicular to the other edge and the normal, scaled to its own edge
+    Vec3f pu = cross(edgeV, s.normal), pv = cross(s.normal, edgeU);
+    s.axisU = pu / dot(edgeU, pu);
+    s.axisV = pv / dot(edgeV, pv);
+    s.material = m;
+    return s;
+}
+
+// Axis-aligned box between lo and hi. A flat axis is given a small thickness so normalAt,
+// which divides by the half extents, stays finite.
+Shape BoxShape(const Vec3f& lo, const Vec3f& hi, MaterialID m) {
+    const float kMinHalf = 1e-4f;
+    Shape s;
+    s.kind = ShapeKind::Box;
+    s.center = (lo + hi) * 0.5f;
+    s.halfSize = Vec3f(max(fabsf(hi.x - lo.x) * 0.5f, kMinHalf), max(fabsf(hi.y - lo.y) * 0.5f, kMinHalf),
+                       max(fabsf(hi.z - lo.z) * 0.5f, kMinHalf));
+    s.material = m;
+    return s;
+}
+
+Shape DiskShape(const Vec3f& center, const Vec3f& normal, float radius, MaterialID m) {
+    Shape s;
+    s.kind = ShapeKind::Disk;
+    s.center = center;
+    s.normal = normalize(normal);
+    s.radius = radius;
+    s.material = m;
+    return s;
+}
+
+enum class LightShape { Point, Sphere, Rect };
+
 struct Light {
-    Vec3f position;
+    Vec3f position; // point light position, or the center of an area light
     Color color;
     float intensity;
+    LightShape shape = LightShape::Point;
+    float radius = 0.0f; // Sphere
+    Vec3f edgeU, edgeV;  // Rect: full edge vectors, centered on position
+    float range = 0.0f;  // > 0: smooth falloff reaching zero at this distance; 0: no falloff
+    Vec3f axis;          // spot direction...
+    float cosCone = -1.0f; // ...lighting only points within this cosine of it; -1: all directions
     Light(const Vec3f& p, const Color& c, float i = 1.0f) : position(p), color(c), intensity(i) {}
+    bool isArea() const { return shape != LightShape::Point; }
+    // Radius around position that holds every sample point
+    float boundingRadius() const {
+        if (shape == LightShape::Sphere) return radius;
+        if (shape == LightShape::Rect) return 0.5f * sqrtf(dot(edgeU, edgeU) + dot(edgeV, edgeV));
+        return 0.0f;
+    }
+
+    // Range falloff and spot cone at p, in [0, 1]; exactly 1 for an unbounded omni light
+    float attenuation(const Vec3f& p) const {
+        if (range <= 0.0f && cosCone <= -1.0f) return 1.0f;
+        Vec3f d = p - position;
+        float dist = d.length();
+        if (cosCone > -1.0f && dot(d, axis) < cosCone * dist) return 0.0f;
+        if (range <= 0.0f) return 1.0f;
+        float x = min(dist / range, 1.0f);
+        return (1.0f - x * x) * (1.0f - x * x);
+    }
+
+    // Point on the emitter for a sample (u, v) in [0,1)^2. A sphere is sampled on the disk it
+    // presents to `from`, which has the same silhouette and so the same visibility.
+    Vec3f samplePoint(const Vec3f& from, float u, float v) const {
+        if (shape == LightShape::Rect) return position + edgeU * (u - 0.5f) + edgeV * (v - 0.5f);
+        if (shape == LightShape::Point) return position;
+        Vec3f w = normalize(from - position);
+        Vec3f t = normalize(cross(fabsf(w.x) > 0.9f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0), w));
+        Vec3f b = cross(w, t);
+        float r = radius * sqrtf(u), phi = 2.0f * float(M_PI) * v;
+        return position + t * (r * cosf(phi)) + b * (r * sinf(phi));
+    }
 };
 
+Light SphereLight(const Vec3f& center, float radius, const Color& c, float i = 1.0f) {
+    Light l(center, c, i);
+    l.shape = LightShape::Sphere;
+    l.radius = radius;
+    return l;
+}
+
+Light RectLight(const Vec3f& center, const Vec3f& edgeU, const Vec3f& edgeV, const Color& c, float i = 1.0f) {
+    Light l(center, c, i);
+    l.shape = LightShape::Rect;
+    l.edgeU = edgeU;
+    l.edgeV = edgeV;
+    return l;
+}
+
 struct HitRecord {
-    float t; Vec3f point; Vec3f normal; Material material; bool hit;
-    HitRecord() : t(numeric_limits<float>::max()), hit(false) {}
+    float t; Vec3f point; Vec3f normal; MaterialID material; bool hit;
+    int primID; // spheres, planes, meshes, instances, then shapes (Scene::planePrimID etc.); -1 for a miss
+    HitRecord() : t(numeric_limits<float>::max()), material(0), hit(false), primID(-1) {}
 };
 
-class Scene {
-public:
-    vector<Sphere> spheres;
-    vector<Plane> planes;
-    vector<Light> lights;
-    Color background;
-    Scene() : background(80,90,110) {}
+enum class PrimType : uint8_t { None, Sphere, Plane, Mesh, Instance, Shape };
 
-    bool intersect(const Ray& ray, HitRecord& rec) const {
-        rec.hit = false;
-        rec.t = numeric_limits<float>::max();
-        for (const auto& s : spheres) {
-            float t;
-            if (s.intersect(ray, t) && t < rec.t) {
-                rec.t = t;
-                rec.point = ray.pointAt(t);
-                rec.normal = s.normalAt(rec.point);
-                rec.material = s.material;
-                rec.hit = true;
-            }
+// All that traversal records for the closest hit so far. Point, normal and material are only
+// evaluated once, for the final hit, by Scene::resolveHit.
+struct TraversalHit {
+    float t = numeric_limits<float>::max();
+    int primID = -1; // Scene primID numbering
+    int subID = -1;  // triangle for meshes and instances
+    PrimType type = PrimType::None;
+};
+
+// Shadow rays spent per light, for the rays-per-pixel report. Keep one per worker.
+struct LightTreeStats {
+    long long queries = 0;  // shading points that asked the light tree
+    long long selected = 0; // lights it returned
+    long long visited = 0;  // nodes popped
+    long long pruned = 0;   // subtrees skipped as below the threshold
+    void add(const LightTreeStats& o) { queries += o.queries; selected += o.selected; visited += o.visited; pruned += o.pruned; }
+};
+
+struct ShadowRayStats {
+    vector<long long> rays; // per light
+    long long pixels = 0;   // shaded primary hits
+    LightTreeStats tree;
+    long long analytic = 0;          // area-light queries answered in closed form...
+    long long analyticFallbacks = 0; // ...or sampled because something other than spheres may block
+    explicit ShadowRayStats(size_t numLights = 0) : rays(numLights, 0) {}
+    void add(const ShadowRayStats& o) {
+        if (rays.size() < o.rays.size()) rays.resize(o.rays.size(), 0);
+        for (size_t i = 0; i < o.rays.size(); ++i) rays[i] += o.rays[i];
+        pixels += o.pixels;
+        tree.add(o.tree);
+        analytic += o.analytic;
+        analyticFallbacks += o.analyticFallbacks;
+    }
+    double raysPerPixel(size_t light) const { return pixels ? double(rays[light]) / pixels : 0.0; }
+    double raysPerPixel() const {
+        long long total = 0;
+        for (long long r : rays) total += r;
+        return pixels ? double(total) / pixels : 0.0;
+    }
+};
+
+struct SecondaryRayStats {
+    long long rays = 0;        // reflection and refraction rays traced
+    long long pixels = 0;      // primary samples shaded
+    long long cutDepth = 0;    // branches dropped at Scene::maxDepth
+    long long cutRoulette = 0; // branches ended by Russian roulette
+    long long cutBudget = 0;   // branches refused because the ray budget was spent
+    void add(const SecondaryRayStats& o) {
+        rays += o.rays; pixels += o.pixels;
+        cutDepth += o.cutDepth; cutRoulette += o.cutRoulette; cutBudget += o.cutBudget;
+    }
+};
+
+// Frame-wide reflection/refraction ray budget, split evenly over the accumulation passes and
+// shared by all workers for one pass. Paths start at full depth while less than half of it is
+// spent; after that their depth limit shrinks with what is left, so a scene that would overrun
+// degrades to shallower reflections across the image rather than losing them in the last tiles.
+// With a binding budget, which pixels lose depth depends on tile scheduling.
+struct RayBudget {
+    long long limit; // rays for this pass; <= 0: unlimited
+    atomic<long long> spent{0};
+    RayBudget(long long frameBudget, int passes) : limit(frameBudget > 0 ? max(1LL, frameBudget / passes) : 0) {}
+
+    int depthLimit(int maxDepth) const {
+        if (limit <= 0) return maxDepth;
+        double left = 1.0 - double(spent.load(memory_order_relaxed)) / limit;
+        if (left >= 0.5) return maxDepth;
+        return max(0, static_cast<int>(ceil(maxDepth * left * 2.0)));
+    }
+};
+
+// One tile's view of the RayBudget: rays are claimed from it in chunks to keep the shared
+// counter cold, and the chunk's unused rest is handed back when the tile is done.
+struct SecondaryRays {
+    static const int kChunk = 64;
+    RayBudget* budget;     // nullptr: unlimited
+    long long reserved = 0; // claimed from budget, not used yet
+    int depthLimit = numeric_limits<int>::max(); // for the current pixel's paths
+    SecondaryRayStats stats;
+
+    explicit SecondaryRays(RayBudget* b) : budget(b && b->limit > 0 ? b : nullptr) {}
+    ~SecondaryRays() { if (budget && reserved > 0) budget->spent.fetch_sub(reserved, memory_order_relaxed); }
+    SecondaryRays(const SecondaryRays&) = delete;
+    SecondaryRays& operator=(const SecondaryRays&) = delete;
+
+    void beginPixel(int maxDepth) {
+        stats.pixels++;
+        depthLimit = budget ? budget->depthLimit(maxDepth) : maxDepth;
+    }
+    // Claims one ray; false (counted as a budget cut) once the pass budget is spent
+    bool take() {
+        if (budget && reserved == 0) {
+            long long before = budget->spent.fetch_add(kChunk, memory_order_relaxed);
+            reserved = min<long long>(kChunk, max(0LL, budget->limit - before));
+            if (reserved < kChunk) budget->spent.fetch_sub(kChunk - reserved, memory_order_relaxed);
+            if (reserved == 0) { stats.cutBudget++; return false; }
         }
-        for (const auto& p : planes) {
-            float t;
-            if (p.intersect(ray, t) && t < rec.t) {
-                rec.t = t;
-                rec.point = ray.pointAt(t);
-                rec.normal = p.normal;
-                rec.material = p.material;
-                rec.hit = true;
-            }
+        if (budget) reserved--;
+        stats.rays++;
+        return true;
+    }
+};
+
+// Arbitrary output variables written by Scene::traceRay in the same pass as the color
+struct AOVSample {
+    float depth = numeric_limits<float>::infinity(); // primary hit distance
+    Vec3f normal;
+    int primID = -1;
+    bool shadowed = false;           // blocked from at least one light (more than half of an area light)
+    uint8_t* lightVisible = nullptr; // optional, one entry per light: 1 = lit, 0 = shadowed
+    ShadowRayStats* rayStats = nullptr; // optional, counts the shadow rays this pixel spends
+    int px = -1, py = -1; // pixel for sampler streams; -1 derives a key from the shading point
+    int pass = 0;         // accumulation pass, offsets sample indices so passes add new samples
+    SecondaryRays* secondary = nullptr; // optional, ray budget and counters for reflection/refraction
+};
+
+// ---------------------- Sampling ----------------------
+// Every sample value is a pure function of (pixel, sample index, dimension) and the sampler seed,
+// so results do not depend on which thread renders which tile. Dimensions are allocated in 2D
+// pairs: kDimPixel for sub-pixel (anti-aliasing) offsets, then two per light (SampleDimLight).
+// kDimLightTree (light-tree selection) takes the otherwise unused second key of the pixel pair.
+const int kDimPixel = 0;
+const int kDimLightTree = 1;
+inline int SampleDimLight(int light) { return 2 + 2 * light; }
+
+// Philox4x32-10 counter-based generator (Salmon et al. 2011)
+struct Philox4x32 {
+    static void round(uint32_t ctr[4], const uint32_t key[2]) {
+        uint64_t p0 = uint64_t(0xD2511F53u) * ctr[0];
+        uint64_t p1 = uint64_t(0xCD9E8D57u) * ctr[2];
+        uint32_t c0 = uint32_t(p1 >> 32) ^ ctr[1] ^ key[0];
+        uint32_t c2 = uint32_t(p0 >> 32) ^ ctr[3] ^ key[1];
+        ctr[0] = c0; ctr[1] = uint32_t(p1); ctr[2] = c2; ctr[3] = uint32_t(p0);
+    }
+    // Four 32-bit outputs for counter (a, b, c, d) under a 64-bit key
+    static void generate(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint64_t seed, uint32_t out[4]) {
+        uint32_t ctr[4] = {a, b, c, d};
+        uint32_t key[2] = {uint32_t(seed), uint32_t(seed >> 32)};
+        for (int r = 0; r < 10; ++r) {
+            round(ctr, key);
+            key[0] += 0x9E3779B9u;
+            key[1] += 0xBB67AE85u;
         }
-        return rec.hit;
+        for (int i = 0; i < 4; ++i) out[i] = ctr[i];
     }
+};
 
-    // Single-sample hard shadow check with normal offset to avoid acne
-    bool isInShadow(const Vec3f& point, const Vec3f& lightPos) const {
-        Vec3f toLight = lightPos - point;
-        float lightDist = toLight.length();
-        Vec3f lightDir = normalize(toLight);
+inline float U32ToUnitFloat(uint32_t x) { return (x >> 8) * (1.0f / 16777216.0f); } // [0, 1), 24 bits
 
-        // Offset along normal: helps avoid self-shadowing (shadow acne)
-        Ray shadowRay(point + lightDir * 1e-4f /* small offset in light direction */,
-                      lightDir);
-        HitRecord srec;
-        if (intersect(shadowRay, srec)) {
-            return srec.t < lightDist;
+inline uint32_t ReverseBits32(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+inline uint32_t HashU32(uint32_t x) {
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Hash-based Owen scrambling (Burley 2020): Laine-Karras permutation applied to the reversed bits
+// flips each bit depending only on the bits above it, i.e. a nested uniform scramble
+inline uint32_t OwenScramble(uint32_t x, uint32_t seed) {
+    x = ReverseBits32(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return ReverseBits32(x);
+}
+
+// First two Sobol dimensions: van der Corput, and the (1, 3, 5, 15, ...) direction numbers.
+// The second is linear over GF(2), so it is evaluated a byte of the index at a time from tables.
+inline void Sobol2D(uint32_t index, uint32_t& x, uint32_t& y) {
+    struct Tables {
+        uint32_t byteTerm[4][256];
+        Tables() {
+            uint32_t dir[32];
+            dir[0] = 1u << 31;
+            for (int k = 1; k < 32; ++k) dir[k] = dir[k - 1] ^ (dir[k - 1] >> 1);
+            for (int b = 0; b < 4; ++b)
+                for (int v = 0; v < 256; ++v) {
+                    uint32_t acc = 0;
+                    for (int bit = 0; bit < 8; ++bit)
+                        if (v & (1 << bit)) acc ^= dir[8 * b + bit];
+                    byteTerm[b][v] = acc;
+                }
         }
-        return false;
+    };
+    static const Tables t;
+    x = ReverseBits32(index);
+    y = t.byteTerm[0][index & 0xffu] ^ t.byteTerm[1][(index >> 8) & 0xffu]
+      ^ t.byteTerm[2][(index >> 16) & 0xffu] ^ t.byteTerm[3][index >> 24];
+}
+
+// Tileable blue-noise threshold map built once by void-and-cluster (Ulichney 1993). Values are
+// ranks scaled to [0, 1), so neighbouring pixels get well separated offsets.
+class BlueNoiseTile {
+public:
+    static const int kSize = 64;
+    static const BlueNoiseTile& get() {
+        static const BlueNoiseTile tile;
+        return tile;
     }
+    float value(int x, int y) const { return rank[(y & (kSize - 1)) * kSize + (x & (kSize - 1))]; }
 
-    // Trace a ray (no recursion for reflections), returns color
-    Color traceRay(const Ray& ray) const {
-        HitRecord rec;
-        if (!intersect(ray, rec)) return background;
+private:
+    vector<float> rank;
 
-        // Start with ambient
-        float ar = rec.material.ambient;
-        Color result = rec.material.color * ar;
+    BlueNoiseTile() : rank(kSize * kSize) {
+        const int n = kSize * kSize;
+        const float sigma2 = 2.0f * 1.9f * 1.9f;
+        const int radius = 6; // Gaussian is negligible beyond this on a toroidal tile
+        vector<float> energy(n, 0.0f);
+        vector<uint8_t> on(n, 0);
+        auto splat = [&](int p, float sign) {
+            int px = p % kSize, py = p / kSize;
+            for (int dy = -radius; dy <= radius; ++dy)
+                for (int dx = -radius; dx <= radius; ++dx) {
+                    int q = ((py + dy) & (kSize - 1)) * kSize + ((px + dx) & (kSize - 1));
+                    energy[q] += sign * expf(-(dx * dx + dy * dy) / sigma2);
+                }
+        };
+        auto extreme = [&](bool wantOn, bool tightest) {
+            int best = -1;
+            for (int p = 0; p < n; ++p) {
+                if (bool(on[p]) != wantOn) continue;
+                if (best < 0 || (tightest ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+            }
+            return best;
+        };
+        // Seed ~10% of the tile with deterministic pseudo-random points, then relax them:
+        // move the tightest cluster into the largest void until that changes nothing
+        int initial = n / 10;
+        for (uint32_t i = 0; initial > 0; ++i) {
+            int p = HashU32(i) % n;
+            if (on[p]) continue;
+            on[p] = 1; splat(p, 1.0f); --initial;
+        }
+        for (int iter = 0; iter < n; ++iter) {
+            int cluster = extreme(true, true);
+            on[cluster] = 0; splat(cluster, -1.0f);
+            int voidPx = extreme(false, false);
+            if (voidPx == cluster) { on[cluster] = 1; splat(cluster, 1.0f); break; }
+            on[voidPx] = 1; splat(voidPx, 1.0f);
+        }
+        // Ranks: remove clusters for the low ranks, then fill voids for the rest
+        vector<uint8_t> prototype = on;
+        vector<float> protoEnergy = energy;
+        int ones = 0;
+        for (uint8_t b : on) ones += b;
+        for (int r = ones - 1; r >= 0; --r) {
+            int p = extreme(true, true);
+            on[p] = 0; splat(p, -1.0f);
+            rank[p] = float(r) / n;
+        }
+        on = prototype;
+        energy = protoEnergy;
+        for (int r = ones; r < n; ++r) {
+            int p = extreme(false, false);
+            on[p] = 1; splat(p, 1.0f);
+            rank[p] = float(r) / n;
+        }
+    }
+};
 
-        for (const auto& light : lights) {
-            // Shadow test (hard shadow)
-            bool inShadow = isInShadow(rec.point, light.position);
-            if (inShadow) continue;
+enum class SamplerType { Random, Sobol, BlueNoise };
 
-            // Diffuse
-            Vec3f lightDir = normalize(light.position - rec.point);
-            float diff = max(0.0f, dot(rec.normal, lightDir));
-            Color diffuse = rec.material.color * (rec.material.diffuse * diff);
+// 2D sample source for multi-sample effects (area-light shadows, sub-pixel offsets).
+//   Random:    Philox keyed by (pixel, sample, dimension)
+//   Sobol:     Owen-scrambled Sobol points, scrambled independently per pixel and dimension
+//   BlueNoise: one Owen-scrambled Sobol sequence shared by all pixels, rotated per pixel by a
+//              blue-noise tile so the remaining error is spread as high-frequency noise
+struct Sampler {
+    SamplerType type;
+    uint64_t seed;
+    explicit Sampler(SamplerType t = SamplerType::Sobol, uint64_t s = 0) : type(t), seed(s) {}
 
-            // Specular (Blinn-Phong)
-            Vec3f viewDir = normalize(-ray.direction);
-            Vec3f halfDir = normalize(lightDir + viewDir);
-            float spec = powf(max(0.0f, dot(rec.normal, halfDir)), rec.material.shininess);
-            Color specCol = light.color * (rec.material.specular * spec);
+    // One pixel's samples for the 2D dimension pair starting at dim. The per-stream hashing is
+    // done here once, so callers drawing many samples (shadow rays) only pay for the sequence.
+    struct Stream {
+        const Sampler* sampler;
+        uint32_t pixel, dim;
+        uint32_t indexScramble, xScramble, yScramble;
+        float offsetU, offsetV; // blue-noise rotation
 
-            // Combine
-            Color contrib = diffuse + specCol;
-            // Multiply by light intensity (and clamp via Color ops)
-            contrib = contrib * light.intensity;
-            result = result + contrib;
+        void get2D(uint32_t index, float& u, float& v) const {
+            if (sampler->type == SamplerType::Random) {
+                uint32_t r[4];
+                Philox4x32::generate(pixel, index, dim, 0, sampler->seed, r);
+                u = U32ToUnitFloat(r[0]);
+                v = U32ToUnitFloat(r[1]);
+                return;
+            }
+            uint32_t sx, sy;
+            Sobol2D(OwenScramble(index, indexScramble), sx, sy); // shuffled order keeps prefixes well spread
+            u = U32ToUnitFloat(OwenScramble(sx, xScramble));
+            v = U32ToUnitFloat(OwenScramble(sy, yScramble));
+            if (sampler->type == SamplerType::BlueNoise) {
+                u += offsetU;
+                v += offsetV;
+                u -= floorf(u);
+                v -= floorf(v);
+            }
         }
+    };
 
-        // final clamp (already handled by Color ops)
-        return result;
+    Stream stream(int x, int y, int dim) const {
+        Stream st;
+        st.sampler = this;
+        st.pixel = uint32_t(y) * 65536u + uint32_t(x);
+        st.dim = uint32_t(dim);
+        uint32_t scramble = HashU32(uint32_t(seed) ^ HashU32(uint32_t(dim) * 0x9E3779B9u));
+        if (type == SamplerType::Sobol) scramble = HashU32(scramble ^ HashU32(st.pixel));
+        st.indexScramble = scramble;
+        st.xScramble = HashU32(scramble ^ 0x68bc21ebu);
+        st.yScramble = HashU32(scramble ^ 0x02e5be93u);
+        st.offsetU = st.offsetV = 0.0f;
+        if (type == SamplerType::BlueNoise) {
+            const BlueNoiseTile& tile = BlueNoiseTile::get();
+            st.offsetU = tile.value(x + 17 * dim, y + 31 * dim);
+            st.offsetV = tile.value(x + 41 * dim + 23, y + 7 * dim + 11);
+        }
+        return st;
+    }
+
+    // Sample `index` of the 2D dimension pair starting at dim, for pixel (x, y)
+    void get2D(int x, int y, uint32_t index, int dim, float& u, float& v) const {
+        stream(x, y, dim).get2D(index, u, v);
     }
 };
 
-// ---------------------- Simple evaluation (shadow pixel counting) ----------------------
-struct EvalMetrics {
-    double renderTimeMs = 0.0;
-    int shadowPixels = 0;
-    float shadowAreaRatio = 0.0f;
+// ---------------------- BVH (binned SAH) ----------------------
+// Interleaves three coordinates in [0, 1023] into a 30-bit Morton code
+inline uint32_t Morton3(float x, float y, float z) {
+    auto spread = [](float f) {
+        uint32_t v = static_cast<uint32_t>(min(max(f, 0.0f), 1023.0f));
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    };
+    return (spread(x) << 2) | (spread(y) << 1) | spread(z);
+}
+
+// BVH nodes visited by traversals on this thread; the ray-sort statistics read the difference
+thread_local long long tlsTraversalSteps = 0;
+
+struct BVHNode {
+    AABB box;
+    int leftFirst; // internal: left child (right child is leftFirst + 1); leaf: first slot in primIdx
+    int count;     // number of primitives in a leaf, 0 for internal nodes
+    bool isLeaf() const { return count > 0; }
 };
 
-EvalMetrics EvaluateImage(const Image& img, float shadowThreshold = 0.30f) {
-    EvalMetrics m;
-    for (const auto& p : img.pix) {
-        if (p.brightness() < shadowThreshold) m.shadowPixels++;
+class BVH {
+public:
+    static const int kBins = 16;
+    static const int kMaxLeafSize = 4;
+    static const int kStackSize = 64;
+    // Deepest node level. A walk holds at most one pending sibling per level plus the current node,
+    // so traversal stacks of kStackSize entries cannot overflow; builds stop splitting there.
+    static const int kMaxDepth = kStackSize - 1;
+
+    vector<BVHNode> nodes;
+    vector<int> primIdx;
+
+    bool empty() const { return nodes.empty(); }
+    int leafCount() const {
+        int n = 0;
+        for (const auto& node : nodes) n += node.isLeaf() ? 1 : 0;
+        return n;
     }
-    m.shadowAreaRatio = static_cast<float>(m.shadowPixels) / (img.W * img.H);
-    return m;
-}
 
-// ---------------------- Scene setup (Case 1: three spheres, hard shadows) ----------------------
-void setupCase1(Scene& scene) {
-    // Materials
-    //Material floorMat(Color(200,200,200), 0.3f, 0.7f, 0.2f, 8.0f);
-    Material sphereMat1(Color(255,220,200), 0.2f, 0.8f, 0.3f, 32.0f);
-    Material sphereMat2(Color(200,220,255), 0.2f, 0.8f, 0.3f, 32.0f);
-    Material sphereMat3(Color(220,255,200), 0.2f, 0.8f, 0.3f, 32.0f);
-    //Material wallMat(Color(150,150,200), 0.4f, 0.6f, 0.2f, 8.0f);
+    // Builds top-down from primitive bounds; leaves hold at most kMaxLeafSize primitives, except at
+    // kMaxDepth, which only degenerate inputs reach
+    void build(const vector<AABB>& boxes) {
+        nodes.clear();
+        primIdx.resize(boxes.size());
+        for (size_t i = 0; i < boxes.size(); ++i) primIdx[i] = static_cast<int>(i);
+        if (boxes.empty()) return;
+        prims = &boxes;
+        nodes.reserve(2 * boxes.size());
+        nodes.push_back(BVHNode{AABB(), 0, static_cast<int>(boxes.size())});
+        subdivide(0, 0);
+        prims = nullptr;
+    }
 
-    // Planes: floor + back wall + left/right walls
-    scene.planes.clear();
-    //scene.planes.push_back(Plane(Vec3f(0, 0, 0), Vec3f(0, 1, 0), floorMat)); // floor
-    //scene.planes.push_back(Plane(Vec3f(0, 0, -5), Vec3f(0, 0, 1), wallMat)); // back wall
-    //scene.planes.push_back(Plane(Vec3f(-5, 0, 0), Vec3f(1, 0, 0), wallMat)); // left
-    //scene.planes.push_back(Plane(Vec3f(5, 0, 0), Vec3f(-1, 0, 0), wallMat)); // right
-    Material sphereMat4(Color(255,180,180), 0.2f, 0.8f, 0.3f, 32.0f);
-    Material sphereMat5(Color(180,255,180), 0.2f, 0.8f, 0.3f, 32.0f);
-    // Spheres: positions & radii match your original scene
-    scene.spheres.clear();
-    scene.spheres.push_back(Sphere(Vec3f(-1.5f, 1.0f, 1.5f), 0.5f, sphereMat1));
-    scene.spheres.push_back(Sphere(Vec3f(1.5f, 0.0f, 2.5f), 0.5f, sphereMat2));
-    scene.spheres.push_back(Sphere(Vec3f(0.0f, 0.5f, 2.0f), 0.5f, sphereMat3));
-    scene.spheres.push_back(Sphere(Vec3f(-0.8f, 2.3f, 1.5f), 0.5f, sphereMat4));
-    scene.spheres.push_back(Sphere(Vec3f(0.8f, 1.8f, 2.0f), 0.5f, sphereMat5));
+    // Linear BVH: sorts primitives along a 30-bit Morton curve of their centroids and splits each
+    // range at the highest differing code bit. Much cheaper than the SAH build at some cost in tree
+    // quality, so it suits per-frame rebuilds. Codes are computed and sorted in per-thread chunks,
+    // the top levels are split serially, and the remaining subtrees are emitted on separate threads.
+    void buildLBVH(const vector<AABB>& boxes, int threads = 0) {
+        nodes.clear();
+        const int n = static_cast<int>(boxes.size());
+        primIdx.resize(n);
+        if (n == 0) return;
+        if (threads <= 0) threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+        threads = min(threads, max(1, n / kMinPrimsPerThread));
 
-    // Light: brighter point light
-    scene.lights.clear();
-    scene.lights.push_back(Light(Vec3f(3.0f, 1.0f, 3.0f), Color(255,255,230), 1.0f));
+        AABB centroidBox;
+        for (const auto& b : boxes) centroidBox.expand(b.centroid());
+        Vec3f ext = centroidBox.hi - centroidBox.lo;
+        Vec3f quant(ext.x > 0 ? 1023.0f / ext.x : 0.0f, ext.y > 0 ? 1023.0f / ext.y : 0.0f, ext.z > 0 ? 1023.0f / ext.z : 0.0f);
 
-    // background
-    scene.background = Color(80,90,110);
-}
+        // (code << 32 | prim) keys so sorting also breaks ties deterministically
+        vector<uint64_t> keys(n);
+        vector<int> chunkStart(threads + 1);
+        for (int c = 0; c <= threads; ++c) chunkStart[c] = static_cast<int>(int64_t(n) * c / threads);
+        ParallelFor(threads, threads, [&](int c) {
+            for (int i = chunkStart[c]; i < chunkStart[c + 1]; ++i) {
+                Vec3f q = (boxes[i].centroid() - centroidBox.lo);
+                uint32_t code = Morton3(q.x * quant.x, q.y * quant.y, q.z * quant.z);
+                keys[i] = (uint64_t(code) << 32) | uint32_t(i);
+            }
+            sort(keys.begin() + chunkStart[c], keys.begin() + chunkStart[c + 1]);
+        });
+        for (int width = 1; width < threads; width *= 2) {
+            for (int c = 0; c + width < threads; c += 2 * width) {
+                inplace_merge(keys.begin() + chunkStart[c], keys.begin() + chunkStart[c + width],
+                              keys.begin() + chunkStart[min(c + 2 * width, threads)]);
+            }
+        }
+        vector<uint32_t> codes(n);
+        for (int i = 0; i < n; ++i) {
+            codes[i] = uint32_t(keys[i] >> 32);
+            primIdx[i] = int(keys[i] & 0xffffffffu);
+        }
 
-// ---------------------- Main render ----------------------
-int main() {
-    const int W = 800;
-    const int H = 600;
+        // Serial top: split until ranges are small enough to hand out as independent subtrees
+        nodes.reserve(2 * n);
+        nodes.push_back(BVHNode{AABB(), 0, n});
+        vector<int> subtreeRoots, depth(1, 0);
+        const int grain = threads > 1 ? max(int(kMaxLeafSize), n / (threads * 4)) : n;
+        for (size_t k = 0; k < nodes.size(); ++k) {
+            BVHNode node = nodes[k];
+            if (node.count <= grain || node.count <= kMaxLeafSize || depth[k] >= kMaxDepth) { subtreeRoots.push_back(int(k)); continue; }
+            int leftCount = MortonSplit(codes, node.leftFirst, node.count);
+            nodes[k] = BVHNode{AABB(), int(nodes.size()), 0};
+            nodes.push_back(BVHNode{AABB(), node.leftFirst, leftCount});
+            nodes.push_back(BVHNode{AABB(), node.leftFirst + leftCount, node.count - leftCount});
+            depth.push_back(depth[k] + 1);
+            depth.push_back(depth[k] + 1);
+        }
 
-    cout << "=== RAY TRACER CASE 1: 3 SPHERES, HARD SHADOWS ===" << endl;
-    cout << "Image: " << W << " x " << H << endl;
+        // Each subtree is emitted into its own array with the root at 0, then spliced in so that
+        // children stay adjacent and always follow their parent (refit relies on that order)
+        vector<vector<BVHNode>> subtrees(subtreeRoots.size());
+        ParallelFor(static_cast<int>(subtreeRoots.size()), threads, [&](int t) {
+            subtrees[t].push_back(nodes[subtreeRoots[t]]);
+            EmitMortonSubtree(subtrees[t], 0, codes, depth[subtreeRoots[t]]);
+        });
+        for (size_t t = 0; t < subtrees.size(); ++t) {
+            const vector<BVHNode>& sub = subtrees[t];
+            int base = static_cast<int>(nodes.size()) - 1; // local index k >= 1 lands at base + k
+            for (size_t k = 0; k < sub.size(); ++k) {
+                BVHNode node = sub[k];
+                if (!node.isLeaf()) node.leftFirst += base;
+                if (k == 0) nodes[subtreeRoots[t]] = node;
+                else nodes.push_back(node);
+            }
+        }
+        refit(boxes);
+    }
 
-    Scene scene;
-    setupCase1(scene);
+    // Recomputes node bounds bottom-up from new primitive boxes; the topology (and primIdx) is kept,
+    // so the primitive count must not change
+    void refit(const vector<AABB>& boxes) {
+        for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; --i) {
+            BVHNode& node = nodes[i];
+            node.box = AABB();
+            if (node.isLeaf()) {
+                for (int k = node.leftFirst; k < node.leftFirst + node.count; ++k) node.box.expand(boxes[primIdx[k]]);
+            } else {
+                node.box.expand(nodes[node.leftFirst].box);
+                node.box.expand(nodes[node.leftFirst + 1].box);
+            }
+        }
+    }
 
-    Image image(W, H);
-    Image shadowMask(W, H, Color(255,255,255)); // white background -> shadow = black
+    // Expected cost of a random ray relative to the root under SAH (unit traversal and intersection
+    // costs). Refitting after motion grows it; comparing against the value at build time tells how
+    // far the tree has degraded.
+    float sahCost() const {
+        if (nodes.empty()) return 0.0f;
+        float rootArea = nodes[0].box.surfaceArea();
+        if (rootArea <= 0.0f) return 0.0f;
+        float cost = 0.0f;
+        for (const auto& node : nodes) cost += node.box.surfaceArea() * (node.isLeaf() ? node.count : 1);
+        return cost / rootArea;
+    }
 
-    // Camera
-    Vec3f cameraPos(0, 3, 8);
-    Vec3f lookAt(0, 0.5f, 0);
-    Vec3f up(0, 1, 0);
-    Vec3f forward = normalize(lookAt - cameraPos);
-    Vec3f right = normalize(cross(forward, up));
-    Vec3f cameraUp = normalize(cross(right, forward));
-    float fov = 60.0f * M_PI / 180.0f;
-    float aspect = static_cast<float>(W) / H;
+    // Front-to-back traversal. visit(prim, tMax) may shrink tMax and returns true to stop early.
+    template<typename Visit>
+    void traverse(const Ray& ray, float tMin, float& tMax, Visit&& visit) const {
+        traverseLeaves(ray, tMin, tMax, [&](int first, int count, float& tLimit) {
+            for (int i = first; i < first + count; ++i) {
+                if (visit(primIdx[i], tLimit)) return true;
+            }
+            return false;
+        });
+    }
 
-    auto t0 = chrono::high_resolution_clock::now();
+    // Same walk, but hands whole leaves to visit(first, count, tMax) as a range of primIdx slots
+    // so callers can keep leaf data contiguous (see SphereSoA).
+    template<typename Visit>
+    void traverseLeaves(const Ray& ray, float tMin, float& tMax, Visit&& visit) const {
+        if (nodes.empty()) return;
+        Vec3f invDir = SafeInverse(ray.direction);
+        float tNear;
+        if (!nodes[0].box.intersect(ray.origin, invDir, tMin, tMax, tNear)) return;
+
+        struct Entry { int node; float tNear; };
+        Entry stack[kStackSize];
+        int sp = 0;
+        stack[sp++] = {0, tNear};
+        while (sp > 0) {
+            Entry e = stack[--sp];
+            ++tlsTraversalSteps;
+            if (e.tNear > tMax) continue; // a closer hit was found after this node was pushed
+            const BVHNode& node = nodes[e.node];
+            if (node.isLeaf()) {
+                if (visit(node.leftFirst, node.count, tMax)) return;
+                continue;
+            }
+            float tl, tr;
+            bool hl = nodes[node.leftFirst].box.intersect(ray.origin, invDir, tMin, tMax, tl);
+            bool hr = nodes[node.leftFirst + 1].box.intersect(ray.origin, invDir, tMin, tMax, tr);
+            // Push the far child first so the near one is popped next
+            if (hl && hr) {
+                if (tl <= tr) { stack[sp++] = {node.leftFirst + 1, tr}; stack[sp++] = {node.leftFirst, tl}; }
+                else          { stack[sp++] = {node.leftFirst, tl}; stack[sp++] = {node.leftFirst + 1, tr}; }
+            } else if (hl) {
+                stack[sp++] = {node.leftFirst, tl};
+            } else if (hr) {
+                stack[sp++] = {node.leftFirst + 1, tr};
+            }
+        }
+    }
 
-    for (int y = 0; y < H; ++y) {
-        for (int x = 0; x < W; ++x) {
-            float px = (2.0f * (x + 0.5f) / W - 1.0f) * tanf(fov / 2.0f) * aspect;
-            float py = (1.0f - 2.0f * (y + 0.5f) / H) * tanf(fov / 2.0f);
+private:
+    static const int kMinPrimsPerThread = 1024; // below this, LBVH threads cost more than they save
+    const vector<AABB>* prims = nullptr;
+
+    // Number of primitives in [first, first + count) that go left: everything before the highest
+    // bit that differs across the (sorted) range, or half when all codes are equal
+    static int MortonSplit(const vector<uint32_t>& codes, int first, int count) {
+        uint32_t a = codes[first], b = codes[first + count - 1];
+        if (a == b) return count / 2;
+        int bit = 31 - __builtin_clz(a ^ b);
+        auto it = partition_point(codes.begin() + first, codes.begin() + first + count,
+                                  [bit](uint32_t c) { return ((c >> bit) & 1u) == 0; });
+        return static_cast<int>(it - codes.begin()) - first;
+    }
 
-            Vec3f rayDir = normalize(forward + right * px + cameraUp * py);
-            Ray r(cameraPos, rayDir);
+    static void EmitMortonSubtree(vector<BVHNode>& out, int nodeIdx, const vector<uint32_t>& codes, int depth) {
+        BVHNode node = out[nodeIdx];
+        if (node.count <= kMaxLeafSize || depth >= kMaxDepth) return;
+        int leftCount = MortonSplit(codes, node.leftFirst, node.count);
+        int left = static_cast<int>(out.size());
+        out[nodeIdx] = BVHNode{AABB(), left, 0};
+        out.push_back(BVHNode{AABB(), node.leftFirst, leftCount});
+        out.push_back(BVHNode{AABB(), node.leftFirst + leftCount, node.count - leftCount});
+        EmitMortonSubtree(out, left, codes, depth + 1);
+        EmitMortonSubtree(out, left + 1, codes, depth + 1);
+    }
 
-            // Trace
-            Color c = scene.traceRay(r);
-            image.PutPixel(x, y, c);
+    // Runs fn(0..count-1) on up to `threads` threads (the calling thread included)
+    template<typename Fn>
+    static void ParallelFor(int count, int threads, Fn&& fn) {
+        atomic<int> next(0);
+        auto worker = [&]() {
+            for (int i = next++; i < count; i = next++) fn(i);
+        };
+        vector<thread> pool;
+        for (int t = 1; t < min(threads, count); ++t) pool.emplace_back(worker);
+        worker();
+        for (auto& th : pool) th.join();
+    }
 
-            // For shadow mask: shoot primary hit then check shadow if hit
-            HitRecord hr;
-            if (scene.intersect(r, hr)) {
-                bool inShadow = scene.isInShadow(hr.point, scene.lights[0].position);
-                if (inShadow) shadowMask.PutPixel(x, y, Color(0,0,0));
-                else shadowMask.PutPixel(x, y, Color(255,255,255));
-            } else {
-                // background -> not shadowed
-                shadowMask.PutPixel(x, y, Color(255,255,255));
+    void subdivide(int nodeIdx, int depth) {
+        BVHNode& node = nodes[nodeIdx];
+        AABB centroidBox;
+        for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+            const AABB& b = (*prims)[primIdx[i]];
+            node.box.expand(b);
+            centroidBox.expand(b.centroid());
+        }
+        if (node.count == 1 || depth >= kMaxDepth) return;
+
+        // Binned SAH: cost of a split is (Nl * Al + Nr * Ar) / A + 1 traversal step
+        int bestAxis = -1, bestSplit = 0;
+        float bestCost = numeric_limits<float>::max();
+        for (int axis = 0; axis < 3; ++axis) {
+            float cmin = centroidBox.lo[axis], cmax = centroidBox.hi[axis];
+            if (cmax - cmin < 1e-8f) continue;
+            AABB binBox[kBins];
+            int binCount[kBins] = {};
+            float scale = kBins / (cmax - cmin);
+            for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                const AABB& b = (*prims)[primIdx[i]];
+                int bin = min(kBins - 1, static_cast<int>((b.centroid()[axis] - cmin) * scale));
+                binCount[bin]++;
+                binBox[bin].expand(b);
+            }
+            float rightArea[kBins - 1];
+            int rightCount[kBins - 1];
+            AABB acc; int n = 0;
+            for (int i = kBins - 1; i > 0; --i) {
+                acc.expand(binBox[i]); n += binCount[i];
+                rightArea[i - 1] = acc.surfaceArea();
+                rightCount[i - 1] = n;
             }
+            acc = AABB(); n = 0;
+            for (int i = 0; i < kBins - 1; ++i) {
+                acc.expand(binBox[i]); n += binCount[i];
+                if (n == 0 || rightCount[i] == 0) continue;
+                float cost = n * acc.surfaceArea() + rightCount[i] * rightArea[i];
+                if (cost < bestCost) { bestCost = cost; bestAxis = axis; bestSplit = i; }
+            }
+        }
+
+        float parentArea = node.box.surfaceArea();
+        float splitCost = (parentArea > 0.0f) ? 1.0f + bestCost / parentArea : numeric_limits<float>::max();
+        bool forceSplit = node.count > kMaxLeafSize;
+        if (!forceSplit && splitCost >= static_cast<float>(node.count)) return;
+
+        int mid;
+        if (bestAxis >= 0) {
+            float cmin = centroidBox.lo[bestAxis];
+            float scale = kBins / (centroidBox.hi[bestAxis] - cmin);
+            int* first = primIdx.data() + node.leftFirst;
+            int* last = first + node.count;
+            int* split = partition(first, last, [&](int p) {
+                int bin = min(kBins - 1, static_cast<int>(((*prims)[p].centroid()[bestAxis] - cmin) * scale));
+                return bin <= bestSplit;
+            });
+            mid = static_cast<int>(split - primIdx.data());
+        } else {
+            // Coincident centroids: no spatial split helps, halve the range to keep leaves bounded
+            mid = node.leftFirst + node.count / 2;
         }
-        if (y % 60 == 0) cout << "Progress: " << (y * 100 / H) << "%" << endl;
+
+        int leftCount = mid - node.leftFirst;
+        int leftIdx = static_cast<int>(nodes.size());
+        nodes.push_back(BVHNode{AABB(), node.leftFirst, leftCount});
+        nodes.push_back(BVHNode{AABB(), mid, node.count - leftCount});
+        node.leftFirst = leftIdx;
+        node.count = 0;
+        subdivide(leftIdx, depth + 1);
+        subdivide(leftIdx + 1, depth + 1);
     }
+};
 
-    auto t1 = chrono::high_resolution_clock::now();
-    double renderMs = chrono::duration<double, milli>(t1 - t0).count();
+// ---------------------- Packed sphere table (SoA) ----------------------
+// Centers and squared radii in structure-of-arrays layout, stored in BVH leaf order so each
+// leaf's spheres are contiguous. One ray is tested against kSimdWidth spheres at a time
+// (16 with AVX-512, 8 with AVX2, scalar otherwise). The arithmetic mirrors Sphere::intersect
+// operation for operation, so hits and t values match it exactly as long as the compiler does
+// not fuse the scalar version into FMAs (-ffp-contract=off); with contraction they agree to
+// float rounding except for near-grazing hits.
+struct SphereSoA {
+#if defined(__AVX512F__)
+    static const int kSimdWidth = 16;
+#elif defined(__AVX2__)
+    static const int kSimdWidth = 8;
+#else
+    static const int kSimdWidth = 1;
+#endif
+    vector<float> cx, cy, cz, r2; // padded by kSimdWidth so vector loads never run past the end
+    vector<int> id;               // slot -> index into Scene::spheres
 
-    // Save outputs
-    image.SavePPM("rtcase2.ppm");
-    shadowMask.SavePPM("rtcase2_shadowmask.ppm");
+    void build(const vector<Sphere>& spheres, const vector<int>& order) {
+        size_t padded = order.size() + kSimdWidth;
+        cx.assign(padded, 0.0f); cy.assign(padded, 0.0f); cz.assign(padded, 0.0f); r2.assign(padded, 0.0f);
+        id = order;
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Sphere& s = spheres[order[i]];
+            cx[i] = s.center.x; cy[i] = s.center.y; cz[i] = s.center.z;
+            r2[i] = s.radius * s.radius;
+        }
+    }
+    size_t size() const { return id.size(); }
 
-    // Evaluate
-    EvalMetrics metrics = EvaluateImage(image, 0.30f);
-    metrics.renderTimeMs = renderMs;
+    // Closest sphere in slots [first, first + count) with t < tMax; shrinks tMax, returns the slot or -1
+    int closestHit(const Ray& ray, int first, int count, float& tMax) const {
+        int best = -1;
+        float t[kSimdWidth];
+        for (int i = first; i < first + count; i += kSimdWidth) {
+            unsigned lanes = hitLanes(ray, i, t) & laneMask(first + count - i);
+            for (int l = 0; lanes; ++l, lanes >>= 1) {
+                if ((lanes & 1u) && t[l] < tMax) { tMax = t[l]; best = i + l; }
+            }
+        }
+        return best;
+    }
 
-    cout << "\n=== SHADOW METRICS ===" << endl;
-    cout << "Shadow pixels (brightness < 0.3): " << metrics.shadowPixels << endl;
-    cout << "Shadow area ratio: " << (metrics.shadowAreaRatio * 100.0f) << " %" << endl;
-    cout << "Render time: " << metrics.renderTimeMs << " ms" << endl;
+    // First slot in [first, first + count) whose sphere is hit with tMin <= t < tMax, or -1
+    int anyHit(const Ray& ray, int first, int count, float tMin, float tMax) const {
+        float t[kSimdWidth];
+        for (int i = first; i < first + count; i += kSimdWidth) {
+            unsigned lanes = hitLanes(ray, i, t) & laneMask(first + count - i);
+            for (int l = 0; lanes; ++l, lanes >>= 1) {
+                if ((lanes & 1u) && t[l] >= tMin && t[l] < tMax) return i + l;
+            }
+        }
+        return -1;
+    }
+
+private:
+    static unsigned laneMask(int n) {
+        return (n >= kSimdWidth) ? (kSimdWidth == 32 ? ~0u : (1u << kSimdWidth) - 1u) : (1u << n) - 1u;
+    }
+
+#if defined(__AVX512F__)
+    unsigned hitLanes(const Ray& ray, int i, float* tOut) const {
+        float a = dot(ray.direction, ray.direction);
+        __m512 dx = _mm512_set1_ps(ray.direction.x), dy = _mm512_set1_ps(ray.direction.y), dz = _mm512_set1_ps(ray.direction.z);
+        __m512 ocx = _mm512_sub_ps(_mm512_set1_ps(ray.origin.x), _mm512_loadu_ps(&cx[i]));
+        __m512 ocy = _mm512_sub_ps(_mm512_set1_ps(ray.origin.y), _mm512_loadu_ps(&cy[i]));
+        __m512 ocz = _mm512_sub_ps(_mm512_set1_ps(ray.origin.z), _mm512_loadu_ps(&cz[i]));
+        __m512 ocd = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, dx), _mm512_mul_ps(ocy, dy)), _mm512_mul_ps(ocz, dz));
+        __m512 b = _mm512_mul_ps(_mm512_set1_ps(2.0f), ocd);
+        __m512 ococ = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz));
+        __m512 c = _mm512_sub_ps(ococ, _mm512_loadu_ps(&r2[i]));
+        __m512 disc = _mm512_sub_ps(_mm512_mul_ps(b, b), _mm512_mul_ps(_mm512_set1_ps(4 * a), c));
+        __mmask16 real = _mm512_cmp_ps_mask(disc, _mm512_setzero_ps(), _CMP_GE_OQ);
+        __m512 sq = _mm512_maskz_sqrt_ps(real, disc);
+        __m512 negB = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(b), _mm512_set1_epi32(0x80000000)));
+        __m512 twoA = _mm512_set1_ps(2 * a);
+        __m512 t0 = _mm512_div_ps(_mm512_sub_ps(negB, sq), twoA);
+        __m512 t1 = _mm512_div_ps(_mm512_add_ps(negB, sq), twoA);
+        __m512 eps = _mm512_set1_ps(0.001f);
+        __m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, eps, _CMP_GT_OQ), t1, t0);
+        __mmask16 hit = real & _mm512_cmp_ps_mask(t, eps, _CMP_GT_OQ);
+        _mm512_storeu_ps(tOut, t);
+        return static_cast<unsigned>(hit);
+    }
+#elif defined(__AVX2__)
+    unsigned hitLanes(const Ray& ray, int i, float* tOut) const {
+        float a = dot(ray.direction, ray.direction);
+        __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+        __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&cx[i]));
+        __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&cy[i]));
+        __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&cz[i]));
+        __m256 ocd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 b = _mm256_mul_ps(_mm256_set1_ps(2.0f), ocd);
+        __m256 ococ = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+        __m256 c = _mm256_sub_ps(ococ, _mm256_loadu_ps(&r2[i]));
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4 * a), c));
+        __m256 real = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ);
+        __m256 sq = _mm256_sqrt_ps(disc);
+        __m256 negB = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+        __m256 twoA = _mm256_set1_ps(2 * a);
+        __m256 t0 = _mm256_div_ps(_mm256_sub_ps(negB, sq), twoA);
+        __m256 t1 = _mm256_div_ps(_mm256_add_ps(negB, sq), twoA);
+        __m256 eps = _mm256_set1_ps(0.001f);
+        __m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, eps, _CMP_GT_OQ));
+        __m256 hit = _mm256_and_ps(real, _mm256_cmp_ps(t, eps, _CMP_GT_OQ));
+        _mm256_storeu_ps(tOut, t);
+        return static_cast<unsigned>(_mm256_movemask_ps(hit));
+    }
+#else
+    unsigned hitLanes(const Ray& ray, int i, float* tOut) const {
+        Vec3f oc = ray.origin - Vec3f(cx[i], cy[i], cz[i]);
+        float a = dot(ray.direction, ray.direction);
+        float b = 2.0f * dot(oc, ray.direction);
+        float c = dot(oc, oc) - r2[i];
+        float disc = b*b - 4*a*c;
+        if (disc < 0) return 0u;
+        float sq = sqrtf(disc);
+        float t0 = (-b - sq) / (2*a);
+        float t1 = (-b + sq) / (2*a);
+        tOut[0] = (t0 > 0.001f) ? t0 : t1;
+        return (tOut[0] > 0.001f) ? 1u : 0u;
+    }
+#endif
+};
+
+// ---------------------- Uniform grid (3D-DDA) ----------------------
+// Regular grid over primitive bounds, cells stored as offsets into one index array. About
+// kCellsPerPrim cells per primitive, shaped to the scene extent (Cleary & Wyvill style), which
+// suits many similar-sized spheres. Rays march cell by cell with a 3D-DDA; a per-thread mailbox
+// keeps primitives that span several cells from being tested twice by the same ray.
+class UniformGrid {
+public:
+    static constexpr float kCellsPerPrim = 3.0f;
+    static const int kMaxRes = 256;
+
+    AABB bounds;
+    int res[3] = {0, 0, 0};
+    Vec3f cellSize, invCellSize;
+    vector<int> cellStart; // cell c holds cellItems[cellStart[c] .. cellStart[c + 1])
+    vector<int> cellItems;
+
+    bool empty() const { return cellItems.empty(); }
+
+    void build(const vector<AABB>& boxes) {
+        bounds = AABB();
+        cellStart.clear();
+        cellItems.clear();
+        numPrims = static_cast<int>(boxes.size());
+        if (boxes.empty()) return;
+        for (const auto& b : boxes) bounds.expand(b);
+        Vec3f ext = bounds.hi - bounds.lo;
+        // Pad flat extents so every axis has a usable cell size
+        float pad = max(max(ext.x, ext.y), ext.z) * 1e-3f + 1e-4f;
+        bounds.lo = bounds.lo - Vec3f(pad, pad, pad);
+        bounds.hi = bounds.hi + Vec3f(pad, pad, pad);
+        ext = bounds.hi - bounds.lo;
+
+        float k = cbrtf(kCellsPerPrim * boxes.size() / (ext.x * ext.y * ext.z));
+        for (int a = 0; a < 3; ++a) res[a] = Clamp(static_cast<int>(ceilf(ext[a] * k)), 1, kMaxRes);
+        cellSize = Vec3f(ext.x / res[0], ext.y / res[1], ext.z / res[2]);
+        invCellSize = Vec3f(1.0f / cellSize.x, 1.0f / cellSize.y, 1.0f / cellSize.z);
+
+        // Two passes: count references per cell, then scatter them
+        size_t numCells = size_t(res[0]) * res[1] * res[2];
+        cellStart.assign(numCells + 1, 0);
+        auto forCells = [&](const AABB& b, auto&& fn) {
+            int c0[3], c1[3];
+            for (int a = 0; a < 3; ++a) {
+                c0[a] = cellCoord(b.lo[a], a);
+                c1[a] = cellCoord(b.hi[a], a);
+            }
+            for (int z = c0[2]; z <= c1[2]; ++z)
+                for (int y = c0[1]; y <= c1[1]; ++y)
+                    for (int x = c0[0]; x <= c1[0]; ++x) fn(cellIndex(x, y, z));
+        };
+        for (const auto& b : boxes) forCells(b, [&](size_t c) { cellStart[c + 1]++; });
+        for (size_t c = 0; c < numCells; ++c) cellStart[c + 1] += cellStart[c];
+        cellItems.resize(cellStart[numCells]);
+        vector<int> fillPos(cellStart.begin(), cellStart.end() - 1);
+        for (int i = 0; i < numPrims; ++i) forCells(boxes[i], [&](size_t c) { cellItems[fillPos[c]++] = i; });
+    }
+
+    // Marches cells front to back. visit(prim, tMax) may shrink tMax and returns true to stop;
+    // the march ends once tMax lies inside the cells already visited.
+    template<typename Visit>
+    void traverse(const Ray& ray, float tMin, float& tMax, Visit&& visit) const {
+        if (cellItems.empty()) return;
+        Vec3f invDir = SafeInverse(ray.direction);
+        float tEnter, tExit;
+        if (!bounds.intersect(ray.origin, invDir, tMin, tMax, tEnter, tExit)) return;
+
+        Vec3f p = ray.pointAt(tEnter);
+        int cell[3], step[3];
+        float tNext[3], tDelta[3];
+        for (int a = 0; a < 3; ++a) {
+            cell[a] = cellCoord(p[a], a);
+            float d = ray.direction[a];
+            if (d > 0.0f) {
+                step[a] = 1;
+                tNext[a] = (bounds.lo[a] + (cell[a] + 1) * cellSize[a] - ray.origin[a]) * invDir[a];
+                tDelta[a] = cellSize[a] * invDir[a];
+            } else if (d < 0.0f) {
+                step[a] = -1;
+                tNext[a] = (bounds.lo[a] + cell[a] * cellSize[a] - ray.origin[a]) * invDir[a];
+                tDelta[a] = -cellSize[a] * invDir[a];
+            } else {
+                step[a] = 0;
+                tNext[a] = numeric_limits<float>::infinity();
+                tDelta[a] = numeric_limits<float>::infinity();
+            }
+        }
+
+        Mailbox& mb = mailbox();
+        if (mb.stamp.size() < size_t(numPrims)) mb.stamp.resize(numPrims, 0);
+        if (++mb.ray == 0) { fill(mb.stamp.begin(), mb.stamp.end(), 0u); mb.ray = 1; }
+
+        while (true) {
+            size_t c = cellIndex(cell[0], cell[1], cell[2]);
+            for (int i = cellStart[c]; i < cellStart[c + 1]; ++i) {
+                int prim = cellItems[i];
+                if (mb.stamp[prim] == mb.ray) continue;
+                mb.stamp[prim] = mb.ray;
+                if (visit(prim, tMax)) return;
+            }
+            int axis = (tNext[0] < tNext[1]) ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            float tCellExit = tNext[axis];
+            if (tMax <= tCellExit || tCellExit > tExit) return;
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= res[axis]) return;
+            tNext[axis] += tDelta[axis];
+        }
+    }
+
+private:
+    struct Mailbox { vector<uint32_t> stamp; uint32_t ray = 0; };
+    static Mailbox& mailbox() { thread_local Mailbox mb; return mb; }
+    int numPrims = 0;
+
+    int cellCoord(float v, int axis) const {
+        return Clamp(static_cast<int>((v - bounds.lo[axis]) * invCellSize[axis]), 0, res[axis] - 1);
+    }
+    size_t cellIndex(int x, int y, int z) const { return (size_t(z) * res[1] + y) * res[0] + x; }
+};
+
+// ---------------------- Triangle meshes ----------------------
+// Watertight ray/triangle test (Woop, Benthin & Wald 2013). The ray is sheared so it runs
+// along +z and the edge functions are evaluated in 2D, with a double-precision retry when one
+// is exactly zero, so rays cannot slip through edges shared by neighbouring triangles.
+struct WatertightRay {
+    Vec3f org;
+    int kx, ky, kz;
+    float Sx, Sy, Sz;
+    explicit WatertightRay(const Ray& r) : org(r.origin) {
+        const Vec3f& d = r.direction;
+        kz = (fabs(d.x) > fabs(d.y)) ? (fabs(d.x) > fabs(d.z) ? 0 : 2) : (fabs(d.y) > fabs(d.z) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0.0f) swap(kx, ky); // keep the winding order
+        Sx = d[kx] / d[kz];
+        Sy = d[ky] / d[kz];
+        Sz = 1.0f / d[kz];
+    }
+
+    // Hit with tMin < t < tMax, either facing
+    bool hit(const Vec3f& p0, const Vec3f& p1, const Vec3f& p2, float tMin, float tMax, float& t) const {
+        Vec3f A = p0 - org, B = p1 - org, C = p2 - org;
+        float Ax = A[kx] - Sx * A[kz], Ay = A[ky] - Sy * A[kz];
+        float Bx = B[kx] - Sx * B[kz], By = B[ky] - Sy * B[kz];
+        float Cx = C[kx] - Sx * C[kz], Cy = C[ky] - Sy * C[kz];
+        float U = Cx * By - Cy * Bx;
+        float V = Ax * Cy - Ay * Cx;
+        float W = Bx * Ay - By * Ax;
+        if (U == 0.0f || V == 0.0f || W == 0.0f) {
+            U = static_cast<float>(double(Cx) * double(By) - double(Cy) * double(Bx));
+            V = static_cast<float>(double(Ax) * double(Cy) - double(Ay) * double(Cx));
+            W = static_cast<float>(double(Bx) * double(Ay) - double(By) * double(Ax));
+        }
+        if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) return false;
+        float det = U + V + W;
+        if (det == 0.0f) return false;
+        float T = U * (Sz * A[kz]) + V * (Sz * B[kz]) + W * (Sz * C[kz]);
+        float tt = T / det;
+        if (!(tt > tMin && tt < tMax)) return false;
+        t = tt;
+        return true;
+    }
+};
+
+struct MeshTriangle { int v0, v1, v2; };
+
+// Indexed triangle mesh (same layout as the rasterizer's Model) with its own BVH over the
+// triangles, so per-ray cost grows with tree depth rather than triangle count.
+struct TriangleMesh {
+    static constexpr float kEpsilon = 0.001f; // same self-hit threshold as Sphere::intersect
+
+    vector<Vec3f> vertices;
+    vector<MeshTriangle> triangles;
+    MaterialID material = 0;
+    BVH bvh; // built by build(); rebuild after editing vertices
+
+    void build() {
+        vector<AABB> boxes;
+        boxes.reserve(triangles.size());
+        for (const auto& f : triangles) {
+            AABB b;
+            b.expand(vertices[f.v0]); b.expand(vertices[f.v1]); b.expand(vertices[f.v2]);
+            boxes.push_back(b);
+        }
+        bvh.build(boxes);
+    }
+    AABB bounds() const { return bvh.empty() ? AABB() : bvh.nodes[0].box; }
+
+    Vec3f faceNormal(int tri) const {
+        const MeshTriangle& f = triangles[tri];
+        return normalize(cross(vertices[f.v1] - vertices[f.v0], vertices[f.v2] - vertices[f.v0]));
+    }
+
+    // Closest triangle with t < tMax; shrinks tMax and reports the triangle index
+    bool intersect(const Ray& ray, float& tMax, int& tri) const {
+        WatertightRay wr(ray);
+        bool found = false;
+        bvh.traverse(ray, kEpsilon, tMax, [&](int i, float& tClosest) {
+            const MeshTriangle& f = triangles[i];
+            float t;
+            if (wr.hit(vertices[f.v0], vertices[f.v1], vertices[f.v2], kEpsilon, tClosest, t)) {
+                tClosest = t;
+                tri = i;
+                found = true;
+            }
+            return false;
+        });
+        return found;
+    }
+
+    bool occluded(const Ray& ray, float tMin, float tMax) const {
+        WatertightRay wr(ray);
+        float lo = max(tMin, kEpsilon);
+        bool blocked = false;
+        bvh.traverse(ray, lo, tMax, [&](int i, float& tLimit) {
+            const MeshTriangle& f = triangles[i];
+            float t;
+            blocked = wr.hit(vertices[f.v0], vertices[f.v1], vertices[f.v2], lo, tLimit, t);
+            return blocked;
+        });
+        return blocked;
+    }
+};
+
+// UV sphere with the same vertex and triangle layout as the rasterizer's MakeSphere(r, nLat, nLon),
+// translated to center
+TriangleMesh MakeSphereMesh(float r, int nLat, int nLon, const Vec3f& center, MaterialID m) {
+    TriangleMesh mesh;
+    mesh.material = m;
+    for (int i = 0; i <= nLat; i++) {
+        float v = i / float(nLat);
+        float theta = v * M_PI;
+        for (int j = 0; j <= nLon; j++) {
+            float u = j / float(nLon);
+            float phi = u * 2 * M_PI;
+            float x = r * sin(theta) * cos(phi);
+            float y = r * cos(theta);
+            float z = r * sin(theta) * sin(phi);
+            mesh.vertices.push_back(Vec3f(x, y, z) + center);
+        }
+    }
+    auto idx = [&](int i, int j) { return i * (nLon + 1) + j; };
+    for (int i = 0; i < nLat; i++) {
+        for (int j = 0; j < nLon; j++) {
+            int a = idx(i, j), b = idx(i, j + 1), c = idx(i + 1, j + 1), d = idx(i + 1, j);
+            mesh.triangles.push_back(MeshTriangle{a, b, c});
+            mesh.triangles.push_back(MeshTriangle{a, c, d});
+        }
+    }
+    return mesh;
+}
+
+// ---------------------- Instancing (TLAS / BLAS) ----------------------
+// A placed copy of a shared model, mirroring the rasterizer's Instance: world = R * (v * scale) + position
+// with R = Rz * Ry * Rx. The model's triangle BVH is the bottom-level structure and is shared by
+// every instance; rays are moved into object space instead of duplicating geometry.
+struct MeshInstance {
+    shared_ptr<const TriangleMesh> model;
+    Vec3f position;
+    Vec3f rotation; // x, y, z angles in radians
+    float scale;
+    MaterialID material; // overrides the model's
+    float R[3][3];     // object -> world rotation, filled by update()
+    AABB worldBounds;  // filled by update()
+
+    MeshInstance(shared_ptr<const TriangleMesh> m, const Vec3f& pos, const Vec3f& rot, float s, MaterialID mat)
+        : model(move(m)), position(pos), rotation(rot), scale(s), material(mat) { update(); }
+
+    // Recomputes the rotation and world bounds after editing position/rotation/scale
+    void update() {
+        float cx = cosf(rotation.x), sx = sinf(rotation.x);
+        float cy = cosf(rotation.y), sy = sinf(rotation.y);
+        float cz = cosf(rotation.z), sz = sinf(rotation.z);
+        float Rx[3][3] = {{1,0,0},{0,cx,-sx},{0,sx,cx}};
+        float Ry[3][3] = {{cy,0,sy},{0,1,0},{-sy,0,cy}};
+        float Rz[3][3] = {{cz,-sz,0},{sz,cz,0},{0,0,1}};
+        float T[3][3];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) {
+                T[i][j] = 0;
+                for (int k = 0; k < 3; k++) T[i][j] += Rz[i][k] * Ry[k][j];
+            }
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) {
+                R[i][j] = 0;
+                for (int k = 0; k < 3; k++) R[i][j] += T[i][k] * Rx[k][j];
+            }
+        worldBounds = AABB();
+        AABB b = model->bounds();
+        for (int c = 0; c < 8; ++c) {
+            Vec3f corner((c & 1) ? b.hi.x : b.lo.x, (c & 2) ? b.hi.y : b.lo.y, (c & 4) ? b.hi.z : b.lo.z);
+            worldBounds.expand(toWorldDir(corner * scale) + position);
+        }
+    }
+
+    Vec3f toWorldDir(const Vec3f& v) const {
+        return Vec3f(R[0][0]*v.x + R[0][1]*v.y + R[0][2]*v.z,
+                     R[1][0]*v.x + R[1][1]*v.y + R[1][2]*v.z,
+                     R[2][0]*v.x + R[2][1]*v.y + R[2][2]*v.z);
+    }
+    Vec3f toObjectDir(const Vec3f& v) const { // R is orthonormal, so its inverse is the transpose
+        return Vec3f(R[0][0]*v.x + R[1][0]*v.y + R[2][0]*v.z,
+                     R[0][1]*v.x + R[1][1]*v.y + R[2][1]*v.z,
+                     R[0][2]*v.x + R[1][2]*v.y + R[2][2]*v.z);
+    }
+    // Object-space ray; with a uniform scale, world t = object t * scale
+    Ray toObject(const Ray& ray) const {
+        return Ray(toObjectDir(ray.origin - position) * (1.0f / scale), toObjectDir(ray.direction));
+    }
+
+    bool intersect(const Ray& ray, float& tMax, int& tri) const {
+        float tObj = tMax / scale;
+        if (!model->intersect(toObject(ray), tObj, tri)) return false;
+        tMax = tObj * scale;
+        return true;
+    }
+    bool occluded(const Ray& ray, float tMin, float tMax) const {
+        return model->occluded(toObject(ray), tMin / scale, tMax / scale);
+    }
+    Vec3f faceNormal(int tri) const { return toWorldDir(model->faceNormal(tri)); }
+};
+
+// ---------------------- Light tree ----------------------
+// Binary hierarchy over Scene::lights (after Conty Estevez & Kulla 2018). Each node bounds its
+// lights' positions, total intensity, falloff range and emission directions, which gives an upper
+// bound on what the node can add at a shading point. Subtrees whose bound is below kPruneThreshold
+// are skipped, and the rest are sampled top-down in proportion to the same bound, so a shading point
+// visits O(log n) nodes instead of every light.
+struct LightSample {
+    int light;
+    float weight; // 1 / probability of having picked this light
+};
+
+class LightTree {
+public:
+    static const int kMaxSamples = 8;               // lights shaded per point
+    static constexpr float kPruneThreshold = 1e-3f; // bound in output units (1.0 = 255), about 1/4 of an 8-bit level
+    static constexpr float kSplitRatio = 0.5f;      // nodes this large relative to their distance are split, not sampled
+
+    void build(const vector<Light>& lights) {
+        nodes.clear();
+        if (lights.empty()) return;
+        vector<int> order(lights.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = static_cast<int>(i);
+        nodes.reserve(2 * lights.size());
+        buildNode(lights, order, 0, static_cast<int>(order.size()));
+    }
+    bool empty() const { return nodes.empty(); }
+    size_t nodeCount() const { return nodes.size(); }
+
+    // Picks up to kMaxSamples lights for the point p with normal n; diffuse/specular are the
+    // material's peak reflectances. u in [0, 1) drives the random choices. Returns the count.
+    int select(const Vec3f& p, const Vec3f& n, float diffuse, float specular, float u, LightSample* out, LightTreeStats* stats) const {
+        if (nodes.empty()) return 0;
+        if (stats) stats->queries++;
+        struct Item { int node; float weight, u; };
+        Item stack[kMaxSamples + 64];
+        int sp = 0, count = 0;
+        if (bound(nodes[0], p, n, diffuse, specular) >= kPruneThreshold) stack[sp++] = {0, 1.0f, u};
+        else if (stats) stats->pruned++;
+        while (sp > 0 && count < kMaxSamples) {
+            Item it = stack[--sp];
+            const Node& nd = nodes[it.node];
+            if (stats) stats->visited++;
+            if (nd.light >= 0) {
+                out[count++] = {nd.light, it.weight};
+                continue;
+            }
+            int left = it.node + 1, right = nd.right;
+            float b0 = bound(nodes[left], p, n, diffuse, specular), b1 = bound(nodes[right], p, n, diffuse, specular);
+            if (b0 < kPruneThreshold) { b0 = 0.0f; if (stats) stats->pruned++; }
+            if (b1 < kPruneThreshold) { b1 = 0.0f; if (stats) stats->pruned++; }
+            if (b0 <= 0.0f && b1 <= 0.0f) continue;
+            // Close, large clusters are split so both halves get their own samples
+            bool split = b0 > 0.0f && b1 > 0.0f && count + sp + 2 <= kMaxSamples && sp + 2 <= int(sizeof stack / sizeof stack[0])
+                         && nd.radius > kSplitRatio * (nd.bounds.centroid() - p).length();
+            if (split) {
+                stack[sp++] = {right, it.weight, it.u};
+                stack[sp++] = {left, it.weight, it.u};
+                continue;
+            }
+            float p0 = b0 / (b0 + b1);
+            if (it.u < p0) stack[sp++] = {left, it.weight / p0, min(it.u / p0, 0.99999994f)};
+            else stack[sp++] = {right, it.weight / (1.0f - p0), min((it.u - p0) / (1.0f - p0), 0.99999994f)};
+        }
+        if (stats) stats->selected += count;
+        return count;
+    }
+
+private:
+    struct Node {
+        AABB bounds;           // light positions (area lights: their centers, which shading uses)
+        float radius;          // half the bounds diagonal
+        float intensity;       // sum of intensities (diffuse term)
+        float specIntensity;   // sum of intensity * peak light color (specular term)
+        float range;           // largest falloff range; 0 if any light is unbounded
+        Vec3f axis;            // cone around every light's spot axis...
+        float thetaO;          // ...of this half-angle; pi when a light emits in all directions
+        float thetaE;          // widest spot half-angle
+        float cosOE, sinOE;    // of thetaO + thetaE, for bound()
+        int right = -1;        // second child; the first is the next node
+        int light = -1;        // leaf: index into Scene::lights
+    };
+    vector<Node> nodes;
+
+    static float RangeWindow(float x) { return x >= 1.0f ? 0.0f : (1.0f - x * x) * (1.0f - x * x); }
+    static float AngleBetween(const Vec3f& a, const Vec3f& b) { return acosf(min(max(dot(a, b), -1.0f), 1.0f)); }
+
+    static Node leaf(const Light& l, int index) {
+        Node nd;
+        nd.bounds = AABB(l.position, l.position);
+        nd.radius = 0.0f;
+        nd.intensity = l.intensity;
+        nd.specIntensity = l.intensity * max(l.color.r, max(l.color.g, l.color.b)) / 255.0f;
+        nd.range = l.range;
+        if (l.cosCone > -1.0f) {
+            nd.axis = l.axis;
+            nd.thetaO = 0.0f;
+            nd.thetaE = acosf(l.cosCone);
+        } else {
+            nd.axis = Vec3f(0, 0, 1);
+            nd.thetaO = float(M_PI);
+            nd.thetaE = float(M_PI);
+        }
+        nd.light = index;
+        SetConeTrig(nd);
+        return nd;
+    }
+
+    static void SetConeTrig(Node& nd) {
+        float a = min(nd.thetaO + nd.thetaE, float(M_PI));
+        nd.cosOE = cosf(a);
+        nd.sinOE = sinf(a);
+    }
+
+    // Smallest cone holding both direction cones (the union used for light bounds in pbrt-v4)
+    static void MergeCones(const Node& a, const Node& b, Vec3f& axis, float& thetaO) {
+        if (a.thetaO >= float(M_PI) || b.thetaO >= float(M_PI)) { axis = a.axis; thetaO = float(M_PI); return; }
+        float thetaD = AngleBetween(a.axis, b.axis);
+        if (min(thetaD + b.thetaO, float(M_PI)) <= a.thetaO) { axis = a.axis; thetaO = a.thetaO; return; }
+        if (min(thetaD + a.thetaO, float(M_PI)) <= b.thetaO) { axis = b.axis; thetaO = b.thetaO; return; }
+        thetaO = 0.5f * (a.thetaO + thetaD + b.thetaO);
+        Vec3f k = cross(a.axis, b.axis);
+        if (thetaO >= float(M_PI) || k.length() < 1e-6f) { axis = a.axis; thetaO = float(M_PI); return; }
+        k = normalize(k);
+        float r = thetaO - a.thetaO; // rotate a's axis towards b's (Rodrigues)
+        axis = normalize(a.axis * cosf(r) + cross(k, a.axis) * sinf(r) + k * (dot(k, a.axis) * (1.0f - cosf(r))));
+    }
+
+    int buildNode(const vector<Light>& lights, vector<int>& order, int first, int last) {
+        int index = static_cast<int>(nodes.size());
+        if (last - first == 1) {
+            nodes.push_back(leaf(lights[order[first]], order[first]));
+            return index;
+        }
+        nodes.push_back(Node());
+        AABB box;
+        for (int i = first; i < last; ++i) box.expand(lights[order[i]].position);
+        Vec3f ext = box.hi - box.lo;
+        int axis = (ext.x > ext.y && ext.x > ext.z) ? 0 : (ext.y > ext.z ? 1 : 2);
+        int mid = (first + last) / 2;
+        nth_element(order.begin() + first, order.begin() + mid, order.begin() + last,
+                    [&](int a, int b) { return lights[a].position[axis] < lights[b].position[axis]; });
+        buildNode(lights, order, first, mid);
+        int right = buildNode(lights, order, mid, last);
+
+        const Node& a = nodes[index + 1];
+        const Node& b = nodes[right];
+        Node nd;
+        nd.bounds = a.bounds;
+        nd.bounds.expand(b.bounds);
+        nd.radius = 0.5f * (nd.bounds.hi - nd.bounds.lo).length();
+        nd.intensity = a.intensity + b.intensity;
+        nd.specIntensity = a.specIntensity + b.specIntensity;
+        nd.range = (a.range > 0.0f && b.range > 0.0f) ? max(a.range, b.range) : 0.0f;
+        MergeCones(a, b, nd.axis, nd.thetaO);
+        nd.thetaE = max(a.thetaE, b.thetaE);
+        SetConeTrig(nd);
+        nd.right = right;
+        nodes[index] = nd;
+        return index;
+    }
+
+    // Upper bound on the node's Blinn-Phong contribution at p (see Scene::lightContribution)
+    static float bound(const Node& nd, const Vec3f& p, const Vec3f& n, float diffuse, float specular) {
+        Vec3f nearest(min(max(p.x, nd.bounds.lo.x), nd.bounds.hi.x), min(max(p.y, nd.bounds.lo.y), nd.bounds.hi.y),
+                      min(max(p.z, nd.bounds.lo.z), nd.bounds.hi.z));
+        float falloff = nd.range > 0.0f ? RangeWindow((nearest - p).length() / nd.range) : 1.0f;
+        if (falloff <= 0.0f) return 0.0f;
+
+        Vec3f toCenter = nd.bounds.centroid() - p;
+        float dist = toCenter.length();
+        if (dist <= nd.radius) return falloff * (nd.intensity * diffuse + nd.specIntensity * specular);
+        Vec3f w = toCenter / dist;
+        // Angle thetaU the bounds subtend from p, kept as sine and cosine
+        float sinU = nd.radius / dist, cosU = sqrtf(max(0.0f, 1.0f - sinU * sinU));
+        // Every spot cone in the node must be able to reach p: prune when the angle between the
+        // axis and the direction to p exceeds thetaO + thetaE + thetaU
+        if (nd.thetaO + nd.thetaE < float(M_PI)) {
+            float cosLimit = nd.cosOE * cosU - nd.sinOE * sinU;
+            bool limitBelowPi = nd.sinOE * cosU + nd.cosOE * sinU > 0.0f;
+            if (limitBelowPi && dot(nd.axis, -w) < cosLimit) return 0.0f;
+        }
+        // ...and some light must be above p's surface: incidence angle thetaI - thetaU < 90 degrees
+        float cosI = dot(n, w);
+        float cosBound = 1.0f;
+        if (cosI < cosU) { // thetaI > thetaU
+            float sinI = sqrtf(max(0.0f, 1.0f - cosI * cosI));
+            cosBound = cosI * cosU + sinI * sinU;
+            if (cosBound <= 0.0f) return 0.0f;
+        }
+        return falloff * (nd.intensity * diffuse * cosBound + nd.specIntensity * specular);
+    }
+};
+
+// Refit/rebuild decisions taken by Scene::updateAccel() across frames
+struct AccelUpdateStats {
+    int refits = 0;
+    int rebuilds = 0;
+    float lastCostRatio = 1.0f; // SAH cost after the last refit relative to the last full build
+    bool lastWasRebuild = false;
+    double lastMs = 0.0;
+};
+
+// Refitted trees are kept until their SAH cost exceeds the last full build's by this factor
+const float kRebuildCostRatio = 1.3f;
+
+// Acceleration structure used for spheres; planes are unbounded and always tested directly
+enum class AccelType { None, BVH, Grid };
+
+class Scene {
+public:
+    vector<Material> materials{Material()}; // shared table; entry 0 is the default material
+    vector<Sphere> spheres;
+    vector<Plane> planes;
+    vector<TriangleMesh> meshes; // each carries its own BVH, built by buildAccel()
+    vector<shared_ptr<const TriangleMesh>> models; // shared bottom-level structures, see addModel()
+    vector<MeshInstance> instances;
+    BVH instanceBVH; // top-level structure over instance world bounds
+    vector<Shape> shapes; // bounded quads, boxes and disks
+    BVH shapeBVH;         // over shape bounds, built by buildAccel()
+    vector<Light> lights;
+    Color background;
+    AccelType accel = AccelType::None;
+    BVH sphereBVH;          // built by buildBVH(); after moving spheres call updateAccel()
+    SphereSoA sphereSoA;    // sphere centers/radii in sphereBVH leaf order
+    UniformGrid sphereGrid; // built by buildGrid()
+    bool useLBVH = false;   // build the sphere BVH with the Morton builder instead of binned SAH
+    int buildThreads = 0;   // threads for LBVH builds, 0 = all hardware threads
+    float builtSAHCost = 0.0f; // sphereBVH.sahCost() right after its last full build
+    AccelUpdateStats updateStats;
+    Sampler sampler;        // area-light (and other multi-sample) sample streams
+    int maxDepth = 5;       // reflection/refraction bounces after the primary hit
+    static const int kRouletteDepth = 2;    // Russian roulette from this bounce on...
+    static constexpr float kRouletteThroughput = 0.25f; // ...for paths weighted below this
+    static constexpr float kMinThroughput = 0.01f; // branches weighted below this are not traced
+    LightTree lightTree;       // built by buildLightTree()
+    bool useLightTree = false; // sample lights through lightTree instead of looping over all of them
+    bool analyticShadows = false; // sphere lights: closed-form visibility when only spheres can block them
+    Scene() : background(80,90,110) {}
+
+    // Appends to the material table; the returned ID is what primitives store
+    MaterialID addMaterial(const Material& m) {
+        if (materials.size() > numeric_limits<MaterialID>::max()) {
+            cerr << "Material table full, using the default material" << endl;
+            return 0;
+        }
+        materials.push_back(m);
+        return static_cast<MaterialID>(materials.size() - 1);
+    }
+
+    int planePrimID(int planeIndex) const { return static_cast<int>(spheres.size()) + planeIndex; }
+    int meshPrimID(int meshIndex) const { return static_cast<int>(spheres.size() + planes.size()) + meshIndex; }
+    int instancePrimID(int instanceIndex) const { return meshPrimID(static_cast<int>(meshes.size())) + instanceIndex; }
+    int shapePrimID(int shapeIndex) const { return instancePrimID(static_cast<int>(instances.size())) + shapeIndex; }
+
+    // Registers a model for instancing and builds its BVH once, however many instances use it
+    shared_ptr<const TriangleMesh> addModel(TriangleMesh mesh) {
+        mesh.build();
+        models.push_back(make_shared<const TriangleMesh>(move(mesh)));
+        return models.back();
+    }
+
+    void buildInstanceBVH() {
+        vector<AABB> boxes;
+        boxes.reserve(instances.size());
+        for (auto& inst : instances) {
+            inst.update();
+            boxes.push_back(inst.worldBounds);
+        }
+        instanceBVH.build(boxes);
+    }
+
+    void buildShapeBVH() {
+        vector<AABB> boxes;
+        boxes.reserve(shapes.size());
+        for (const auto& sh : shapes) boxes.push_back(sh.bounds());
+        shapeBVH.build(boxes);
+    }
+
+    vector<AABB> sphereBounds() const {
+        vector<AABB> boxes;
+        boxes.reserve(spheres.size());
+        for (const auto& s : spheres) boxes.push_back(s.bounds());
+        return boxes;
+    }
+
+    void buildBVH() {
+        vector<AABB> boxes = sphereBounds();
+        if (useLBVH) sphereBVH.buildLBVH(boxes, buildThreads);
+        else sphereBVH.build(boxes);
+        builtSAHCost = sphereBVH.sahCost();
+        sphereSoA.build(spheres, sphereBVH.primIdx);
+        accel = AccelType::BVH;
+    }
+
+    // Per-frame update after moving entries of spheres (the count must stay the same for a refit).
+    // The sphere BVH is refitted while its SAH cost stays within kRebuildCostRatio of the last full
+    // build, and rebuilt with the parallel Morton builder once it drifts past that. The grid has no
+    // refit and is simply rebuilt.
+    void updateAccel() {
+        auto t0 = chrono::high_resolution_clock::now();
+        buildInstanceBVH();
+        if (accel == AccelType::BVH && sphereBVH.primIdx.size() == spheres.size()) {
+            vector<AABB> boxes = sphereBounds();
+            sphereBVH.refit(boxes);
+            float cost = sphereBVH.sahCost();
+            updateStats.lastCostRatio = builtSAHCost > 0.0f ? cost / builtSAHCost : 1.0f;
+            if (updateStats.lastCostRatio > kRebuildCostRatio) {
+                sphereBVH.buildLBVH(boxes, buildThreads);
+                builtSAHCost = sphereBVH.sahCost();
+                updateStats.rebuilds++;
+                updateStats.lastWasRebuild = true;
+            } else {
+                updateStats.refits++;
+                updateStats.lastWasRebuild = false;
+            }
+            sphereSoA.build(spheres, sphereBVH.primIdx);
+        } else {
+            buildAccel(accel);
+            updateStats.rebuilds++;
+            updateStats.lastWasRebuild = true;
+        }
+        updateStats.lastMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count();
+    }
+
+    void buildGrid() {
+        sphereGrid.build(sphereBounds());
+        accel = AccelType::Grid;
+    }
+
+    // Builds the requested sphere structure (AccelType::None falls back to testing every sphere)
+    // plus the per-mesh triangle BVHs
+    void buildAccel(AccelType type) {
+        for (auto& m : meshes) m.build();
+        buildInstanceBVH();
+        buildShapeBVH();
+        if (type == AccelType::BVH) buildBVH();
+        else if (type == AccelType::Grid) buildGrid();
+        else accel = AccelType::None;
+    }
+
+    string accelSummary() const {
+        string meshInfo;
+        if (!meshes.empty()) {
+            size_t tris = 0;
+            for (const auto& m : meshes) tris += m.triangles.size();
+            meshInfo = "; " + to_string(meshes.size()) + " mesh BVHs, " + to_string(tris) + " triangles";
+        }
+        if (!instances.empty()) {
+            size_t tris = 0;
+            for (const auto& m : models) tris += m->triangles.size();
+            meshInfo += "; TLAS over " + to_string(instances.size()) + " instances of " + to_string(models.size())
+                + " models (" + to_string(tris) + " unique triangles)";
+        }
+        if (!shapes.empty()) meshInfo += "; BVH over " + to_string(shapes.size()) + " shapes";
+        return sphereAccelSummary() + meshInfo;
+    }
+
+    string sphereAccelSummary() const {
+        switch (accel) {
+        case AccelType::BVH:
+            return string(useLBVH ? "LBVH, " : "BVH, ") + to_string(sphereBVH.nodes.size()) + " nodes, "
+                + to_string(sphereBVH.leafCount()) + " leaves, SAH cost " + to_string(sphereBVH.sahCost());
+        case AccelType::Grid:
+            return "grid " + to_string(sphereGrid.res[0]) + "x" + to_string(sphereGrid.res[1]) + "x" + to_string(sphereGrid.res[2])
+                + ", " + to_string(sphereGrid.cellItems.size()) + " sphere refs";
+        default:
+            return "none, brute force";
+        }
+    }
+
+    // Closest sphere hit below tMax through the active structure; shrinks tMax, returns the index or -1
+    int closestSphere(const Ray& ray, float& tMax) const {
+        int best = -1;
+        switch (accel) {
+        case AccelType::BVH:
+            sphereBVH.traverseLeaves(ray, 0.0f, tMax, [&](int first, int count, float& tClosest) {
+                int slot = sphereSoA.closestHit(ray, first, count, tClosest);
+                if (slot >= 0) best = sphereSoA.id[slot];
+                return false;
+            });
+            break;
+        case AccelType::Grid:
+            sphereGrid.traverse(ray, 0.0f, tMax, [&](int i, float& tClosest) {
+                float t;
+                if (spheres[i].intersect(ray, t) && t < tClosest) { tClosest = t; best = i; }
+                return false;
+            });
+            break;
+        default:
+            for (size_t i = 0; i < spheres.size(); ++i) {
+                float t;
+                if (spheres[i].intersect(ray, t) && t < tMax) { tMax = t; best = static_cast<int>(i); }
+            }
+        }
+        return best;
+    }
+
+    // Any sphere hit inside [tMin, tMax] through the active structure, or -1
+    int occludingSphere(const Ray& ray, float tMin, float tMax) const {
+        int blocker = -1;
+        switch (accel) {
+        case AccelType::BVH:
+            sphereBVH.traverseLeaves(ray, tMin, tMax, [&](int first, int count, float& tLimit) {
+                int slot = sphereSoA.anyHit(ray, first, count, tMin, tLimit);
+                if (slot >= 0) blocker = sphereSoA.id[slot];
+                return slot >= 0;
+            });
+            break;
+        case AccelType::Grid:
+            sphereGrid.traverse(ray, tMin, tMax, [&](int i, float& tLimit) {
+                float t;
+                if (spheres[i].intersect(ray, t) && t >= tMin && t < tLimit) blocker = i;
+                return blocker >= 0;
+            });
+            break;
+        default:
+            for (size_t i = 0; i < spheres.size(); ++i) {
+                float t;
+                if (spheres[i].intersect(ray, t) && t >= tMin && t < tMax) return static_cast<int>(i);
+            }
+        }
+        return blocker;
+    }
+
+    // Closest plane, mesh, instance or shape hit below tMax (outside the sphere structure).
+    // Shrinks tMax and returns the primID or -1; subID receives the triangle for meshes.
+    int closestOther(const Ray& ray, float& tMax, int& subID) const {
+        int best = -1;
+        for (size_t i = 0; i < planes.size(); ++i) {
+            float t;
+            if (planes[i].intersect(ray, t) && t < tMax) { tMax = t; best = planePrimID(static_cast<int>(i)); }
+        }
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            if (meshes[i].intersect(ray, tMax, subID)) best = meshPrimID(static_cast<int>(i));
+        }
+        instanceBVH.traverse(ray, 0.0f, tMax, [&](int i, float& tClosest) {
+            if (instances[i].intersect(ray, tClosest, subID)) best = instancePrimID(i);
+            return false;
+        });
+        shapeBVH.traverse(ray, 0.0f, tMax, [&](int i, float& tClosest) {
+            float t;
+            if (shapes[i].intersect(ray, t) && t < tClosest) { tClosest = t; best = shapePrimID(i); }
+            return false;
+        });
+        return best;
+    }
+
+    PrimType primType(int primID) const {
+        if (primID < 0) return PrimType::None;
+        if (primID < planePrimID(0)) return PrimType::Sphere;
+        if (primID < meshPrimID(0)) return PrimType::Plane;
+        if (primID < instancePrimID(0)) return PrimType::Mesh;
+        if (primID < shapePrimID(0)) return PrimType::Instance;
+        return PrimType::Shape;
+    }
+
+    // Closest hit as (t, primID, subID, type) only; nothing is evaluated for hits later replaced
+    TraversalHit closestHit(const Ray& ray) const {
+        TraversalHit h;
+        h.primID = closestSphere(ray, h.t);
+        int other = closestOther(ray, h.t, h.subID);
+        if (other >= 0) h.primID = other;
+        h.type = primType(h.primID);
+        return h;
+    }
+
+    // Point, normal and material for a hit found by one of the queries above
+    void resolveHit(const Ray& ray, const TraversalHit& h, HitRecord& rec) const {
+        rec.t = h.t;
+        rec.point = ray.pointAt(h.t);
+        rec.primID = h.primID;
+        rec.hit = true;
+        switch (h.type) {
+        case PrimType::Sphere:
+            rec.normal = spheres[h.primID].normalAt(rec.point);
+            rec.material = spheres[h.primID].material;
+            break;
+        case PrimType::Plane: {
+            const Plane& p = planes[h.primID - planePrimID(0)];
+            rec.normal = p.normal;
+            rec.material = p.material;
+            break;
+        }
+        case PrimType::Mesh: {
+            const TriangleMesh& m = meshes[h.primID - meshPrimID(0)];
+            Vec3f n = m.faceNormal(h.subID);
+            rec.normal = (dot(n, ray.direction) > 0.0f) ? -n : n;
+            rec.material = m.material;
+            break;
+        }
+        case PrimType::Instance: {
+            const MeshInstance& inst = instances[h.primID - instancePrimID(0)];
+            Vec3f n = inst.faceNormal(h.subID);
+            rec.normal = (dot(n, ray.direction) > 0.0f) ? -n : n;
+            rec.material = inst.material;
+            break;
+        }
+        case PrimType::Shape: {
+            const Shape& sh = shapes[h.primID - shapePrimID(0)];
+            Vec3f n = sh.normalAt(rec.point);
+            rec.normal = (dot(n, ray.direction) > 0.0f) ? -n : n;
+            rec.material = sh.material;
+            break;
+        }
+        case PrimType::None:
+            rec = HitRecord();
+            break;
+        }
+    }
+
+    bool intersect(const Ray& ray, HitRecord& rec) const {
+        rec = HitRecord();
+        TraversalHit h = closestHit(ray);
+        if (h.primID >= 0) resolveHit(ray, h, rec);
+        return rec.hit;
+    }
+
+    // Any-hit query: true as soon as something blocks the segment [tMin, tMax].
+    // Unlike intersect() it never fills a HitRecord, so shadow rays skip point/normal/material work.
+    bool occluded(const Ray& ray, float tMin, float tMax) const {
+        return findOccluder(ray, tMin, tMax) >= 0;
+    }
+
+    // Same any-hit query, reporting which primitive (primID numbering) blocked the segment, or -1
+    int findOccluder(const Ray& ray, float tMin, float tMax) const {
+        int blocker = occludingSphere(ray, tMin, tMax);
+        if (blocker >= 0) return blocker;
+        for (size_t i = 0; i < planes.size(); ++i) {
+            float t;
+            if (planes[i].intersect(ray, t) && t >= tMin && t < tMax) return planePrimID(static_cast<int>(i));
+        }
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            if (meshes[i].occluded(ray, tMin, tMax)) return meshPrimID(static_cast<int>(i));
+        }
+        float tLimit = tMax;
+        instanceBVH.traverse(ray, tMin, tLimit, [&](int i, float&) {
+            if (instances[i].occluded(ray, tMin, tMax)) blocker = instancePrimID(i);
+            return blocker >= 0;
+        });
+        if (blocker >= 0) return blocker;
+        tLimit = tMax;
+        shapeBVH.traverse(ray, tMin, tLimit, [&](int i, float&) {
+            float t;
+            if (shapes[i].intersect(ray, t) && t >= tMin && t < tMax) blocker = shapePrimID(i);
+            return blocker >= 0;
+        });
+        return blocker;
+    }
+
+    // Tests a single primitive (primID numbering) against the segment [tMin, tMax]
+    bool occludedBy(const Ray& ray, int primID, float tMin, float tMax) const {
+        float t;
+        if (primID >= shapePrimID(0)) return shapes[primID - shapePrimID(0)].intersect(ray, t) && t >= tMin && t < tMax;
+        if (primID >= instancePrimID(0)) return instances[primID - instancePrimID(0)].occluded(ray, tMin, tMax);
+        if (primID >= meshPrimID(0)) return meshes[primID - meshPrimID(0)].occluded(ray, tMin, tMax);
+        bool hit = (primID < static_cast<int>(spheres.size()))
+            ? spheres[primID].intersect(ray, t)
+            : planes[primID - spheres.size()].intersect(ray, t);
+        return hit && t >= tMin && t < tMax;
+    }
+
+    // Single-sample hard shadow check with normal offset to avoid acne.
+    // With a cache, the last occluder of light `light` in this tile is tried before the full query.
+    bool isInShadow(const Vec3f& point, const Vec3f& lightPos, ShadowCache* cache = nullptr, int light = 0) const {
+        float lightDist;
+        Ray shadowRay = ShadowRayTo(point, lightPos, lightDist);
+        return occludedCached(shadowRay, lightDist, cache, light);
+    }
+
+    // Shadow ray from point towards target; lightDist receives the distance to the target
+    static Ray ShadowRayTo(const Vec3f& point, const Vec3f& target, float& lightDist) {
+        Vec3f origin, lightDir;
+        ShadowSegment(point, target, origin, lightDir, lightDist);
+        return Ray(origin, lightDir);
+    }
+
+    // Origin and direction of that shadow ray, for callers that queue rays instead of tracing them
+    static void ShadowSegment(const Vec3f& point, const Vec3f& target, Vec3f& origin, Vec3f& lightDir, float& lightDist) {
+        Vec3f toLight = target - point;
+        lightDist = toLight.length();
+        lightDir = normalize(toLight);
+
+        // Offset along normal: helps avoid self-shadowing (shadow acne)
+        origin = point + lightDir * 1e-4f; // small offset in light direction
+    }
+
+    // Any-hit test of a shadow ray over [0, lightDist], trying the cached occluder first.
+    // Rays leaving the tile's culling box test only the tile's list for their light, if any.
+    bool occludedCached(const Ray& shadowRay, float lightDist, ShadowCache* cache, int light) const {
+        if (!cache) return occluded(shadowRay, 0.0f, lightDist);
+
+        cache->stats.queries++;
+        const pair<int, int>* list = cache->culling ? cullList(*cache, shadowRay.origin, light) : nullptr;
+        if (list && list->second == 0) {
+            cache->stats.culledRays++;
+            return false;
+        }
+        int& last = cache->lastOccluder[light];
+        if (last >= 0 && cache->reuseOccluder) {
+            cache->stats.probes++;
+            if (occludedBy(shadowRay, last, 0.0f, lightDist)) {
+                cache->stats.hits++;
+                cache->stats.blocked++;
+                return true;
+            }
+        }
+        int blocker = -1;
+        if (list) {
+            cache->stats.listedRays++;
+            for (int k = list->first; k < list->first + list->second && blocker < 0; ++k) {
+                cache->stats.listTests++;
+                if (occludedBy(shadowRay, cache->occluders[k], 0.0f, lightDist)) blocker = cache->occluders[k];
+            }
+        } else {
+            blocker = findOccluder(shadowRay, 0.0f, lightDist);
+        }
+        if (blocker >= 0) {
+            last = blocker; // lit pixels keep the old entry; the shadow may resume
+            cache->stats.blocked++;
+        }
+        return blocker >= 0;
+    }
+
+    static constexpr float kCullPad = 1e-3f; // covers the shadow-ray origin offset and rounding
+
+    // Starts tile culling from the tile's primary hits recs[0, n): bounds their points. Occluder
+    // lists are then built per light on first use, so lights a tile never queries cost nothing.
+    void beginTileCull(ShadowCache& cache, const HitRecord* recs, int n) const {
+        AABB box;
+        for (int i = 0; i < n; ++i) if (recs[i].hit) box.expand(recs[i].point);
+        cache.culling = box.lo.x <= box.hi.x;
+        if (!cache.culling) return;
+        Vec3f pad(kCullPad, kCullPad, kCullPad);
+        cache.cullLo = box.lo - pad;
+        cache.cullHi = box.hi + pad;
+        cache.lists.assign(lights.size(), make_pair(-1, 0));
+        cache.occluders.clear();
+    }
+
+    // Light li's list for a ray starting at origin, or nullptr when origin is outside the tile box
+    // (secondary hits, other tiles' points) and the full query has to answer
+    const pair<int, int>* cullList(ShadowCache& cache, const Vec3f& origin, int li) const {
+        for (int a = 0; a < 3; ++a)
+            if (origin[a] < cache.cullLo[a] || origin[a] > cache.cullHi[a]) return nullptr;
+        if (cache.lists[li].first < 0) buildCullList(cache, li);
+        return &cache.lists[li];
+    }
+
+    // Every primitive that meets the hull of the tile box's bounding sphere and light li's
+    // bounding sphere. Planes use the box corners instead: a plane with the whole box and the whole
+    // light on one side cannot cut a segment between them (hit points lying on it count as that side).
+    // Quads and disks must pass both tests.
+    void buildCullList(ShadowCache& cache, int li) const {
+        const Light& light = lights[li];
+        Vec3f center = (cache.cullLo + cache.cullHi) * 0.5f;
+        RoundCone hull(center, (cache.cullHi - cache.cullLo).length() * 0.5f, light.position, light.boundingRadius() + kCullPad);
+        const int first = static_cast<int>(cache.occluders.size());
+        auto separates = [&](const Vec3f& point, const Vec3f& normal) {
+            float dMin = numeric_limits<float>::max(), dMax = -dMin;
+            for (int c = 0; c < 8; ++c) {
+                Vec3f corner((c & 1) ? cache.cullHi.x : cache.cullLo.x, (c & 2) ? cache.cullHi.y : cache.cullLo.y,
+                             (c & 4) ? cache.cullHi.z : cache.cullLo.z);
+                float d = dot(corner - point, normal);
+                dMin = min(dMin, d);
+                dMax = max(dMax, d);
+            }
+            float dLight = dot(light.position - point, normal), rLight = light.boundingRadius() + kCullPad;
+            bool above = dMin >= -kCullPad && dLight - rLight > 0.0f;
+            bool below = dMax <= kCullPad && dLight + rLight < 0.0f;
+            return above || below;
+        };
+        forEachSphereIn(hull, [&](int s) { cache.occluders.push_back(s); });
+        for (size_t i = 0; i < planes.size(); ++i)
+            if (!separates(planes[i].point, planes[i].normal)) cache.occluders.push_back(planePrimID(static_cast<int>(i)));
+        for (size_t i = 0; i < meshes.size(); ++i)
+            if (hull.overlaps(meshes[i].bounds())) cache.occluders.push_back(meshPrimID(static_cast<int>(i)));
+        for (size_t i = 0; i < instances.size(); ++i)
+            if (hull.overlaps(instances[i].worldBounds)) cache.occluders.push_back(instancePrimID(static_cast<int>(i)));
+        for (size_t i = 0; i < shapes.size(); ++i) {
+            const Shape& sh = shapes[i];
+            if (!hull.overlaps(sh.bounds()) || (sh.kind != ShapeKind::Box && separates(sh.center, sh.normal))) continue;
+            cache.occluders.push_back(shapePrimID(static_cast<int>(i)));
+        }
+        cache.lists[li] = make_pair(first, static_cast<int>(cache.occluders.size()) - first);
+        cache.stats.cullPairs++;
+        if (cache.lists[li].second == 0) cache.stats.emptyPairs++;
+    }
+
+    // Calls fn(index) for every sphere meeting hull, through the sphere BVH when there is one
+    template<typename Fn>
+    void forEachSphereIn(const RoundCone& hull, Fn&& fn) const {
+        auto consider = [&](int s) {
+            if (hull.overlaps(spheres[s].center, spheres[s].radius)) fn(s);
+        };
+        if (accel == AccelType::BVH && !sphereBVH.empty()) {
+            int stack[BVH::kStackSize];
+            int sp = 0;
+            stack[sp++] = 0;
+            while (sp > 0) {
+                const BVHNode& node = sphereBVH.nodes[stack[--sp]];
+                if (!hull.overlaps(node.box)) continue;
+                if (node.isLeaf()) {
+                    for (int k = 0; k < node.count; ++k) consider(sphereBVH.primIdx[node.leftFirst + k]);
+                } else {
+                    stack[sp++] = node.leftFirst;
+                    stack[sp++] = node.leftFirst + 1;
+                }
+            }
+        } else {
+            for (size_t s = 0; s < spheres.size(); ++s) consider(static_cast<int>(s));
+        }
+    }
+
+    // Closed-form visibility of sphere light li from point (--analytic-shadows): each sphere occluder
+    // leaves the part of the light's cap outside its own cap open, and occluders combine as if
+    // independent, multiplying those open fractions. Returns false, so the caller samples instead,
+    // for other light shapes, when any other primitive may be in the way, or when an occluder
+    // reaches through the plane of the light's disk.
+    bool analyticVisibility(const Vec3f& point, int li, float& visible, ShadowRayStats* stats = nullptr) const {
+        const Light& light = lights[li];
+        Vec3f toLight = light.position - point;
+        float dL = toLight.length();
+        bool closed = light.shape == LightShape::Sphere && dL > light.radius;
+        RoundCone hull(point, kCullPad, light.position, light.radius);
+        for (size_t i = 0; i < planes.size() && closed; ++i) {
+            const Plane& pl = planes[i];
+            float dp = dot(point - pl.point, pl.normal), dl = dot(light.position - pl.point, pl.normal);
+            closed = (dp >= -kCullPad && dl - light.radius > 0.0f) || (dp <= kCullPad && dl + light.radius < 0.0f);
+        }
+        for (size_t i = 0; i < meshes.size() && closed; ++i) closed = !hull.overlaps(meshes[i].bounds());
+        for (size_t i = 0; i < instances.size() && closed; ++i) closed = !hull.overlaps(instances[i].worldBounds);
+        for (size_t i = 0; i < shapes.size() && closed; ++i) {
+            const Shape& sh = shapes[i];
+            float dp = dot(point - sh.center, sh.normal), dl = dot(light.position - sh.center, sh.normal);
+            bool oneSide = sh.kind != ShapeKind::Box
+                && ((dp >= -kCullPad && dl - light.radius > 0.0f) || (dp <= kCullPad && dl + light.radius < 0.0f));
+            closed = oneSide || !hull.overlaps(sh.bounds());
+        }
+        if (!closed) {
+            if (stats) stats->analyticFallbacks++;
+            return false;
+        }
+
+        // Light::samplePoint spreads a sphere light's samples over the disk it presents to the point,
+        // so the cap is that disk's (half-angle atan(r / d)), not the sphere's silhouette
+        Vec3f dirL = toLight / dL;
+        double cosL = dL / sqrt(double(dL) * dL + double(light.radius) * light.radius);
+        const double capL = 1.0 - cosL;
+        // The cap/cap overlap is exact only for spheres wholly in front of the disk; spheres wholly
+        // behind it cannot reach the segments, and any in between cut the disk itself
+        double open = 1.0;
+        bool straddles = false;
+        forEachSphereIn(hull, [&](int s) {
+            Vec3f toOcc = spheres[s].center - point;
+            float dO = toOcc.length(), along = dot(toOcc, dirL), r = spheres[s].radius;
+            if (along - r >= dL) return;
+            if (along + r > dL) { straddles = true; return; }
+            double sinO = min(1.0, double(r) / dO), cosO = sqrt(1.0 - sinO * sinO);
+            open *= max(0.0, 1.0 - CapOverlap(cosL, cosO, along / dO) / capL);
+        });
+        if (stats) (straddles ? stats->analyticFallbacks : stats->analytic)++;
+        if (straddles) return false;
+        visible = float(open);
+        return true;
+    }
+
+    // Solid angle shared by two spherical caps with half-angle cosines cos1, cos2 whose axes are
+    // cosD apart, divided by 2*pi (a cap alone gives 1 - cos). Mazonka 2012, eq. 40.
+    static double CapOverlap(double cos1, double cos2, double cosD) {
+        cosD = min(1.0, max(-1.0, cosD));
+        double a1 = acos(cos1), a2 = acos(cos2), d = acos(cosD);
+        if (d >= a1 + a2) return 0.0;
+        if (d <= fabs(a1 - a2)) return 1.0 - max(cos1, cos2); // the smaller cap lies inside the other
+        double sin1 = sin(a1), sin2 = sin(a2), sinD = sin(d);
+        auto sacos = [](double x) { return acos(min(1.0, max(-1.0, x))); };
+        double omega = M_PI - sacos((cosD - cos1 * cos2) / (sin1 * sin2)) - cos1 * sacos((cos2 - cosD * cos1) / (sinD * sin1))
+                     - cos2 * sacos((cos1 - cosD * cos2) / (sinD * sin2));
+        return max(0.0, omega / M_PI); // eq. 40 gives 2 * omega
+    }
+
+    static const int kMinShadowSamples = 4;  // first pass for an area light
+    static const int kMaxShadowSamples = 32; // total once the first pass disagrees (penumbra)
+
+    // Fraction of light `li` visible from point. A point light takes one ray. An area light starts
+    // with kMinShadowSamples rays and spends the rest of kMaxShadowSamples only when they disagree,
+    // so fully lit and umbra pixels cost about as much as a hard shadow.
+    float lightVisibility(const Vec3f& point, int li, ShadowCache* cache = nullptr, ShadowRayStats* stats = nullptr,
+                          int px = -1, int py = -1, int pass = 0) const {
+        const Light& light = lights[li];
+        if (!light.isArea()) {
+            if (stats) stats->rays[li]++;
+            return isInShadow(point, light.position, cache, li) ? 0.0f : 1.0f;
+        }
+        float closed;
+        if (analyticShadows && analyticVisibility(point, li, closed, stats)) {
+            if (stats) stats->rays[li]++; // one query, counted as one ray
+            return closed;
+        }
+        KeyPixel(point, px, py);
+        Sampler::Stream stream = sampler.stream(px, py, SampleDimLight(li));
+        int lit = 0, n = 0;
+        for (; n < kMaxShadowSamples; ++n) {
+            if (n == kMinShadowSamples && (lit == 0 || lit == n)) break;
+            if (!isInShadow(point, lightSamplePoint(stream, point, li, pass, n), cache, li)) lit++;
+        }
+        if (stats) stats->rays[li] += n;
+        return float(lit) / n;
+    }
+
+    // FNV-1a over the coordinate bits, for sample streams that have no pixel to key on
+    static uint32_t PointKey(const Vec3f& point) {
+        uint32_t h = 2166136261u;
+        for (int a = 0; a < 3; ++a) {
+            uint32_t bits;
+            float f = point[a];
+            memcpy(&bits, &f, sizeof bits);
+            h = (h ^ bits) * 16777619u;
+        }
+        return h;
+    }
+
+    // No pixel given (px < 0): key sample streams by the shading point instead
+    static void KeyPixel(const Vec3f& point, int& px, int& py) {
+        if (px >= 0) return;
+        uint32_t h = PointKey(point);
+        px = int(h & 0xffffu);
+        py = int(h >> 16);
+    }
+
+    // Point on light li for shadow sample n of the given accumulation pass
+    Vec3f lightSamplePoint(const Sampler::Stream& stream, const Vec3f& point, int li, int pass, int n) const {
+        float u, v;
+        stream.get2D(uint32_t(pass * kMaxShadowSamples + n), u, v);
+        return lights[li].samplePoint(point, u, v);
+    }
+
+    // Trace a primary ray, returns unclamped linear color including reflection/refraction.
+    // If aov is given it receives depth/normal/primitive ID and per-light shadowing from the same pass.
+    ColorF traceRay(const Ray& ray, AOVSample* aov = nullptr, ShadowCache* cache = nullptr) const {
+        HitRecord rec;
+        intersect(ray, rec);
+        return shade(ray, rec, aov, cache);
+    }
+
+    // Shading for a primary hit that is already known (packet tracing resolves hits itself)
+    ColorF shade(const Ray& ray, const HitRecord& rec, AOVSample* aov = nullptr, ShadowCache* cache = nullptr) const {
+        SecondaryRays* sec = aov ? aov->secondary : nullptr;
+        if (sec) sec->beginPixel(maxDepth);
+        if (!rec.hit) {
+            if (aov && aov->lightVisible) fill(aov->lightVisible, aov->lightVisible + lights.size(), uint8_t(1));
+            return ColorF(background);
+        }
+        if (aov) {
+            aov->depth = rec.t;
+            aov->normal = rec.normal;
+            aov->primID = rec.primID;
+        }
+        ShadowRayStats* rayStats = aov ? aov->rayStats : nullptr;
+        if (rayStats) rayStats->pixels++;
+
+        // Start with ambient
+        ColorF result = ambient(rec);
+
+        if (useLightTree) result = result + treeLighting(ray, rec, aov, cache);
+        else for (size_t li = 0; li < lights.size(); ++li) {
+            if (lights[li].attenuation(rec.point) <= 0.0f) continue; // out of range or outside the spot cone
+            // Shadow test: hard for point lights, fractional for area lights
+            float visible = aov ? lightVisibility(rec.point, static_cast<int>(li), cache, rayStats, aov->px, aov->py, aov->pass)
+                                : lightVisibility(rec.point, static_cast<int>(li), cache);
+            recordVisibility(aov, static_cast<int>(li), visible);
+            if (visible <= 0.0f) continue;
+            result = result + lightContribution(ray, rec, static_cast<int>(li), visible);
+        }
+
+        const Material& mat = materials[rec.material];
+        if (!mat.hasSecondary()) return result;
+        return result * mat.localWeight() + secondary(ray, rec, sec, cache, 0, 1.0f);
+    }
+
+    // Reflection and refraction leaving hit rec of ray. depth counts the bounces already taken and
+    // throughput is the path weight so far; sec (optional) supplies the ray budget and counters.
+    // Branches are traced strongest first, so a short budget drops the weakest ones.
+    ColorF secondary(const Ray& ray, const HitRecord& rec, SecondaryRays* sec, ShadowCache* cache, int depth, float throughput) const {
+        const Material& mat = materials[rec.material];
+        if (!mat.hasSecondary()) return ColorF();
+        if (depth >= maxDepth) {
+            if (sec) sec->stats.cutDepth++;
+            return ColorF();
+        }
+        if (sec && depth >= sec->depthLimit) { // depth lowered by a tight budget
+            sec->stats.cutBudget++;
+            return ColorF();
+        }
+        // Russian roulette: weak paths survive with probability proportional to their weight and are
+        // reweighted to stay unbiased; a survivor never carries more than kRouletteThroughput
+        float rouletteWeight = 1.0f;
+        if (depth >= kRouletteDepth && throughput < kRouletteThroughput) {
+            float survive = throughput / kRouletteThroughput;
+            float u = U32ToUnitFloat(HashU32(PointKey(rec.point) ^ uint32_t(depth) * 0x9E3779B9u ^ uint32_t(sampler.seed)));
+            if (u >= survive) {
+                if (sec) sec->stats.cutRoulette++;
+                return ColorF();
+            }
+            rouletteWeight = 1.0f / survive;
+        }
+
+        Vec3f d = ray.direction;
+        Vec3f n = rec.normal;
+        float cosI = -dot(d, n);
+        bool inside = cosI < 0.0f; // leaving a transparent object
+        if (inside) { n = -n; cosI = -cosI; }
+        float eta = inside ? mat.ior : 1.0f / mat.ior;
+
+        // Schlick's Fresnel splits the transparent share between reflection and refraction
+        float reflectW = mat.reflectivity, refractW = 0.0f;
+        Vec3f refractDir;
+        if (mat.transparency > 0.0f) {
+            float sin2T = eta * eta * (1.0f - cosI * cosI);
+            if (sin2T >= 1.0f) {
+                reflectW += mat.transparency; // total internal reflection
+            } else {
+                float r0 = (1.0f - mat.ior) / (1.0f + mat.ior);
+                r0 *= r0;
+                float kr = r0 + (1.0f - r0) * powf(1.0f - cosI, 5.0f);
+                reflectW += mat.transparency * kr;
+                refractW = mat.transparency * (1.0f - kr);
+                refractDir = normalize(d * eta + n * (eta * cosI - sqrtf(1.0f - sin2T)));
+            }
+        }
+
+        struct Branch { Vec3f origin, dir; float weight; };
+        Branch branches[2];
+        int numBranches = 0;
+        if (reflectW > 0.0f) branches[numBranches++] = {rec.point + n * 1e-4f, normalize(d + n * (2.0f * cosI)), reflectW};
+        if (refractW > 0.0f) branches[numBranches++] = {rec.point - n * 1e-4f, refractDir, refractW};
+        if (numBranches == 2 && branches[1].weight > branches[0].weight) swap(branches[0], branches[1]);
+
+        ColorF result;
+        for (int b = 0; b < numBranches; ++b) {
+            float w = branches[b].weight * rouletteWeight;
+            if (throughput * w < kMinThroughput) continue;
+            if (sec && !sec->take()) break;
+            Ray r(branches[b].origin, branches[b].dir);
+            HitRecord hit;
+            ColorF c;
+            if (!intersect(r, hit)) {
+                c = ColorF(background);
+            } else {
+                const Material& hm = materials[hit.material];
+                c = ambient(hit);
+                if (useLightTree) c = c + treeLighting(r, hit, nullptr, cache);
+                else for (size_t li = 0; li < lights.size(); ++li) {
+                    if (lights[li].attenuation(hit.point) <= 0.0f) continue;
+                    float visible = lightVisibility(hit.point, static_cast<int>(li), cache);
+                    if (visible > 0.0f) c = c + lightContribution(r, hit, static_cast<int>(li), visible);
+                }
+                if (hm.hasSecondary()) c = c * hm.localWeight() + secondary(r, hit, sec, cache, depth + 1, throughput * w);
+            }
+            result = result + c * w;
+        }
+        return result;
+    }
+
+    // Builds the light tree over the current lights and shades through it from then on
+    void buildLightTree() {
+        lightTree.build(lights);
+        useLightTree = !lightTree.empty();
+    }
+
+    // Lights the tree picks for a shading point, from pixel (px, py)'s kDimLightTree stream
+    int selectLights(const HitRecord& rec, int px, int py, int pass, LightSample* out, LightTreeStats* stats) const {
+        const Material& mat = materials[rec.material];
+        float diffuse = mat.diffuse * max(mat.color.r, max(mat.color.g, mat.color.b)) / 255.0f;
+        float u, v;
+        sampler.get2D(px, py, uint32_t(pass), kDimLightTree, u, v);
+        return lightTree.select(rec.point, rec.normal, diffuse, mat.specular, u, out, stats);
+    }
+
+    // Shadow-ray target for a light the tree picked: one sample per light and pass
+    Vec3f selectedLightTarget(const Vec3f& point, int li, int px, int py, int pass) const {
+        if (!lights[li].isArea()) return lights[li].position;
+        return lightSamplePoint(sampler.stream(px, py, SampleDimLight(li)), point, li, pass, 0);
+    }
+
+    // Direct light through the light tree: one shadow ray per picked light, each weighted by
+    // 1 / its selection probability. Area-light penumbrae converge over accumulation passes.
+    ColorF treeLighting(const Ray& ray, const HitRecord& rec, AOVSample* aov, ShadowCache* cache) const {
+        int px = aov ? aov->px : -1, py = aov ? aov->py : -1, pass = aov ? aov->pass : 0;
+        KeyPixel(rec.point, px, py);
+        ShadowRayStats* rayStats = aov ? aov->rayStats : nullptr;
+        LightSample picks[LightTree::kMaxSamples];
+        int count = selectLights(rec, px, py, pass, picks, rayStats ? &rayStats->tree : nullptr);
+        ColorF result;
+        for (int k = 0; k < count; ++k) {
+            int li = picks[k].light;
+            if (rayStats) rayStats->rays[li]++;
+            bool visible = !isInShadow(rec.point, selectedLightTarget(rec.point, li, px, py, pass), cache, li);
+            recordVisibility(aov, li, visible ? 1.0f : 0.0f);
+            if (visible) result = result + lightContribution(ray, rec, li, picks[k].weight);
+        }
+        return result;
+    }
+
+    ColorF ambient(const HitRecord& rec) const {
+        const Material& mat = materials[rec.material];
+        return ColorF(mat.color) * mat.ambient;
+    }
+
+    static void recordVisibility(AOVSample* aov, int li, float visible) {
+        if (!aov) return;
+        bool inShadow = visible < 0.5f;
+        aov->shadowed = aov->shadowed || inShadow;
+        if (aov->lightVisible) aov->lightVisible[li] = inShadow ? 0 : 1;
+    }
+
+    // Blinn-Phong diffuse + specular from light li, scaled by its intensity, attenuation and visible
+    // fraction (or sample weight); no clamping until HDRBuffer::resolve
+    ColorF lightContribution(const Ray& ray, const HitRecord& rec, int li, float visible) const {
+        const Light& light = lights[li];
+        const Material& mat = materials[rec.material];
+
+        // Diffuse
+        Vec3f lightDir = normalize(light.position - rec.point);
+        float diff = max(0.0f, dot(rec.normal, lightDir));
+        ColorF diffuse = ColorF(mat.color) * (mat.diffuse * diff);
+
+        // Specular (Blinn-Phong)
+        Vec3f viewDir = normalize(-ray.direction);
+        Vec3f halfDir = normalize(lightDir + viewDir);
+        float spec = diff > 0.0f ? powf(max(0.0f, dot(rec.normal, halfDir)), mat.shininess) : 0.0f; // lit side only
+        ColorF specCol = ColorF(light.color) * (mat.specular * spec);
+
+        // Combine
+        ColorF contrib = diffuse + specCol;
+        return contrib * (light.intensity * light.attenuation(rec.point) * visible);
+    }
+};
+
+// ---------------------- AOV buffers ----------------------
+// Full-frame storage for AOVSample results. Each pixel owns its own slots, so tiles can be
+// written from several threads without locking.
+struct AOVBuffers {
+    static const int kMaxLightMasks = 16; // more lights get no per-light masks (W*H bytes each)
+    int W, H, numLights;
+    vector<float> depth;
+    vector<Vec3f> normal;
+    vector<int> primID;
+    vector<uint8_t> shadowed;
+    vector<uint8_t> lightVisible; // W*H*numLights
+
+    AOVBuffers(int w, int h, int lightCount)
+        : W(w), H(h), numLights(lightCount <= kMaxLightMasks ? lightCount : 0), depth(w*h, numeric_limits<float>::infinity()), normal(w*h),
+          primID(w*h, -1), shadowed(w*h, 0), lightVisible(size_t(w)*h*numLights, 1) {}
+
+    // Sample for pixel (x, y) in accumulation pass `pass`; pass to traceRay, then store() on pass 0.
+    // Only pass 0 is bound to the per-light slots, so they match the other AOVs instead of whichever
+    // jittered pass ran last.
+    AOVSample sampleFor(int x, int y, int pass) {
+        AOVSample s;
+        if (numLights > 0 && pass == 0) s.lightVisible = &lightVisible[(size_t(y) * W + x) * numLights];
+        s.px = x;
+        s.py = y;
+        s.pass = pass;
+        return s;
+    }
+    void store(int x, int y, const AOVSample& s) {
+        int i = y * W + x;
+        depth[i] = s.depth;
+        normal[i] = s.normal;
+        primID[i] = s.primID;
+        shadowed[i] = s.shadowed ? 1 : 0;
+    }
+
+    // Binary shadow mask: black = shadowed from at least one light
+    Image shadowMask() const {
+        Image img(W, H, Color(255,255,255));
+        for (int i = 0; i < W * H; ++i) if (shadowed[i]) img.pix[i] = Color(0,0,0);
+        return img;
+    }
+    // Pixels where the per-light masks disagree with the shadow mask (shadowed from at least one
+    // light); both come from pass 0, so anything but 0 means they were written by different passes
+    int maskMismatches() const {
+        if (numLights == 0) return 0;
+        int bad = 0;
+        for (int i = 0; i < W * H; ++i) {
+            bool any = false;
+            for (int l = 0; l < numLights; ++l) any = any || !lightVisible[size_t(i) * numLights + l];
+            if (any != (shadowed[i] != 0)) bad++;
+        }
+        return bad;
+    }
+    Image lightMask(int light) const {
+        Image img(W, H, Color(255,255,255));
+        for (int i = 0; i < W * H; ++i) if (!lightVisible[size_t(i) * numLights + light]) img.pix[i] = Color(0,0,0);
+        return img;
+    }
+    // Depth mapped to gray between the nearest and farthest hit (background black)
+    Image depthImage() const {
+        float lo = numeric_limits<float>::max(), hi = 0.0f;
+        for (float d : depth) if (isfinite(d)) { lo = min(lo, d); hi = max(hi, d); }
+        Image img(W, H, Color(0,0,0));
+        for (int i = 0; i < W * H; ++i) {
+            if (!isfinite(depth[i])) continue;
+            uint8_t v = ClampUint8(static_cast<int>(255.0f * (1.0f - (depth[i] - lo) / max(hi - lo, 1e-6f))), 0, 255);
+            img.pix[i] = Color(v, v, v);
+        }
+        return img;
+    }
+    Image normalImage() const {
+        Image img(W, H, Color(0,0,0));
+        for (int i = 0; i < W * H; ++i) {
+            if (primID[i] < 0) continue;
+            const Vec3f& n = normal[i];
+            img.pix[i] = Color(ClampUint8(static_cast<int>((n.x * 0.5f + 0.5f) * 255.0f), 0, 255),
+                               ClampUint8(static_cast<int>((n.y * 0.5f + 0.5f) * 255.0f), 0, 255),
+                               ClampUint8(static_cast<int>((n.z * 0.5f + 0.5f) * 255.0f), 0, 255));
+        }
+        return img;
+    }
+    // One hashed color per primitive
+    Image primIDImage() const {
+        Image img(W, H, Color(0,0,0));
+        for (int i = 0; i < W * H; ++i) {
+            if (primID[i] < 0) continue;
+            uint32_t h = static_cast<uint32_t>(primID[i] + 1) * 2654435761u;
+            img.pix[i] = Color(uint8_t(h >> 24), uint8_t(h >> 16), uint8_t(h >> 8));
+        }
+        return img;
+    }
+    void SaveExtra(const string& prefix) const {
+        depthImage().SavePPM(prefix + "_depth.ppm");
+        normalImage().SavePPM(prefix + "_normal.ppm");
+        primIDImage().SavePPM(prefix + "_primid.ppm");
+        for (int l = 0; l < numLights; ++l) lightMask(l).SavePPM(prefix + "_light" + to_string(l) + ".ppm");
+    }
+};
+
+// ---------------------- Camera ----------------------
+// Pixel rectangle [x0, x1) x [y0, y1)
+struct Tile { int x0, y0, x1, y1; };
+
+// Pinhole camera with the basis and tan(fov/2) computed once instead of per pixel
+struct Camera {
+    Vec3f position, forward, right, up;
+    int W, H;
+    float tanHalfFov, aspect;
+    Camera(const Vec3f& pos, const Vec3f& lookAt, const Vec3f& upHint, float fov, int w, int h)
+        : position(pos), W(w), H(h), tanHalfFov(tanf(fov / 2.0f)), aspect(static_cast<float>(w) / h) {
+        forward = normalize(lookAt - pos);
+        right = normalize(cross(forward, upHint));
+        up = normalize(cross(right, forward));
+    }
+    // Unnormalized direction through the center of pixel (x, y)
+    Vec3f direction(int x, int y) const { return direction(x, y, 0.5f, 0.5f); }
+    // Same, through offset (sx, sy) in [0,1)^2 inside the pixel (e.g. from Sampler, dim kDimPixel)
+    Vec3f direction(int x, int y, float sx, float sy) const {
+        float px = (2.0f * (x + sx) / W - 1.0f) * tanHalfFov * aspect;
+        float py = (1.0f - 2.0f * (y + sy) / H) * tanHalfFov;
+        return forward + right * px + up * py;
+    }
+    Ray primaryRay(int x, int y) const { return Ray(position, normalize(direction(x, y))); }
+    Ray primaryRay(int x, int y, float sx, float sy) const { return Ray(position, normalize(direction(x, y, sx, sy))); }
+};
+
+// ---------------------- Primary ray packets ----------------------
+// kDim x kDim camera rays sharing one origin, directions in SoA layout. The four corner rays
+// span a frustum; spheres and BVH nodes entirely outside it are skipped for the whole packet.
+struct RayPacket {
+    static const int kDim = 8;
+    static const int kRays = kDim * kDim;
+    Vec3f origin;
+    int x0, y0, w, h; // pixel rect covered; lanes past w*h are padding
+    alignas(64) float dx[kRays];
+    alignas(64) float dy[kRays];
+    alignas(64) float dz[kRays];
+    alignas(64) float t[kRays];
+    int sphere[kRays]; // closest sphere index, -1 if none
+    int other[kRays];  // primID of a closer plane or mesh hit, else -1
+    int subID[kRays];  // triangle index for mesh hits
+    Vec3f frustumN[4]; // inward side-plane normals through origin
+
+    Ray ray(int i) const { return Ray(origin, Vec3f(dx[i], dy[i], dz[i])); }
+
+    // Packet at (px0, py0), clipped to the pixel bounds (px1, py1)
+    void generate(const Camera& cam, int px0, int py0, int px1, int py1) {
+        origin = cam.position;
+        x0 = px0; y0 = py0;
+        w = min(int(kDim), px1 - px0);
+        h = min(int(kDim), py1 - py0);
+        // Directions are affine in pixel coordinates, so step from the tile corner
+        Vec3f base = cam.direction(px0, py0);
+        Vec3f stepX = cam.right * (2.0f / cam.W * cam.tanHalfFov * cam.aspect);
+        Vec3f stepY = cam.up * (-2.0f / cam.H * cam.tanHalfFov);
+        for (int i = 0; i < kRays; ++i) {
+            int lx = (i % kDim < w) ? i % kDim : 0;
+            int ly = (i / kDim < h) ? i / kDim : 0;
+            Vec3f d = normalize(base + stepX * static_cast<float>(lx) + stepY * static_cast<float>(ly));
+            dx[i] = d.x; dy[i] = d.y; dz[i] = d.z;
+            t[i] = numeric_limits<float>::max();
+            sphere[i] = -1;
+            other[i] = -1;
+        }
+        Vec3f c00(dx[0], dy[0], dz[0]);
+        Vec3f c10 = corner(w - 1, 0), c11 = corner(w - 1, h - 1), c01 = corner(0, h - 1);
+        Vec3f inside = c00 + c10 + c11 + c01;
+        const Vec3f corners[4] = {c00, c10, c11, c01};
+        for (int e = 0; e < 4; ++e) {
+            Vec3f n = cross(corners[e], corners[(e + 1) % 4]);
+            if (dot(n, inside) < 0) n = -n;
+            frustumN[e] = normalize(n); // degenerate edges give a zero normal, which culls nothing
+        }
+    }
+
+    bool cullSphere(const Vec3f& center, float radius) const {
+        Vec3f rel = center - origin;
+        for (const auto& n : frustumN) {
+            if (dot(n, rel) < -radius) return true;
+        }
+        return false;
+    }
+
+    bool cullBox(const AABB& b) const {
+        for (const auto& n : frustumN) {
+            // Vertex furthest along n; if even that is behind the plane the box is outside
+            Vec3f pv(n.x >= 0 ? b.hi.x : b.lo.x, n.y >= 0 ? b.hi.y : b.lo.y, n.z >= 0 ? b.hi.z : b.lo.z);
+            if (dot(n, pv - origin) < 0) return true;
+        }
+        return false;
+    }
+
+private:
+    Vec3f corner(int lx, int ly) const { int i = ly * kDim + lx; return Vec3f(dx[i], dy[i], dz[i]); }
+};
+
+// One sphere against every ray of a packet, kSimdWidth rays per step. The origin is shared, so
+// oc and c are scalars; the per-lane arithmetic follows Sphere::intersect.
+void PacketHitSphere(RayPacket& pk, const Vec3f& center, float r2, int id) {
+    Vec3f oc = pk.origin - center;
+    float c = dot(oc, oc) - r2;
+    const int n = RayPacket::kRays; // padding lanes repeat valid rays, so they are harmless
+#if defined(__AVX512F__) || defined(__AVX2__)
+#if defined(__AVX512F__)
+    const int kW = 16;
+    typedef __m512 V;
+    auto set1 = [](float v) { return _mm512_set1_ps(v); };
+    auto load = [](const float* p) { return _mm512_load_ps(p); };
+    auto add = [](V a, V b) { return _mm512_add_ps(a, b); };
+    auto sub = [](V a, V b) { return _mm512_sub_ps(a, b); };
+    auto mul = [](V a, V b) { return _mm512_mul_ps(a, b); };
+    auto div = [](V a, V b) { return _mm512_div_ps(a, b); };
+#else
+    const int kW = 8;
+    typedef __m256 V;
+    auto set1 = [](float v) { return _mm256_set1_ps(v); };
+    auto load = [](const float* p) { return _mm256_load_ps(p); };
+    auto add = [](V a, V b) { return _mm256_add_ps(a, b); };
+    auto sub = [](V a, V b) { return _mm256_sub_ps(a, b); };
+    auto mul = [](V a, V b) { return _mm256_mul_ps(a, b); };
+    auto div = [](V a, V b) { return _mm256_div_ps(a, b); };
+#endif
+    V ocx = set1(oc.x), ocy = set1(oc.y), ocz = set1(oc.z), vc = set1(c);
+    V two = set1(2.0f), four = set1(4.0f), eps = set1(0.001f);
+    alignas(64) float tHit[kW];
+    for (int i = 0; i < n; i += kW) {
+        V dx = load(pk.dx + i), dy = load(pk.dy + i), dz = load(pk.dz + i);
+        V a = add(add(mul(dx, dx), mul(dy, dy)), mul(dz, dz));
+        V b = mul(two, add(add(mul(ocx, dx), mul(ocy, dy)), mul(ocz, dz)));
+        V disc = sub(mul(b, b), mul(mul(four, a), vc));
+        V twoA = mul(two, a);
+#if defined(__AVX512F__)
+        __mmask16 real = _mm512_cmp_ps_mask(disc, _mm512_setzero_ps(), _CMP_GE_OQ);
+        V sq = _mm512_maskz_sqrt_ps(real, disc);
+        V negB = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(b), _mm512_set1_epi32(0x80000000)));
+        V t0 = div(sub(negB, sq), twoA), t1 = div(add(negB, sq), twoA);
+        V t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, eps, _CMP_GT_OQ), t1, t0);
+        unsigned hit = real & _mm512_cmp_ps_mask(t, eps, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t, load(pk.t + i), _CMP_LT_OQ);
+        _mm512_store_ps(tHit, t);
+#else
+        V real = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ);
+        V sq = _mm256_sqrt_ps(disc);
+        V negB = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+        V t0 = div(sub(negB, sq), twoA), t1 = div(add(negB, sq), twoA);
+        V t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, eps, _CMP_GT_OQ));
+        V hitV = _mm256_and_ps(_mm256_and_ps(real, _mm256_cmp_ps(t, eps, _CMP_GT_OQ)), _mm256_cmp_ps(t, load(pk.t + i), _CMP_LT_OQ));
+        unsigned hit = static_cast<unsigned>(_mm256_movemask_ps(hitV));
+        _mm256_store_ps(tHit, t);
+#endif
+        for (int l = 0; hit; ++l, hit >>= 1) {
+            if (hit & 1u) { pk.t[i + l] = tHit[l]; pk.sphere[i + l] = id; }
+        }
+    }
+#else
+    for (int i = 0; i < n; ++i) {
+        float a = pk.dx[i]*pk.dx[i] + pk.dy[i]*pk.dy[i] + pk.dz[i]*pk.dz[i];
+        float b = 2.0f * (oc.x*pk.dx[i] + oc.y*pk.dy[i] + oc.z*pk.dz[i]);
+        float disc = b*b - 4*a*c;
+        if (disc < 0) continue;
+        float sq = sqrtf(disc);
+        float t0 = (-b - sq) / (2*a);
+        float t1 = (-b + sq) / (2*a);
+        float t = (t0 > 0.001f) ? t0 : t1;
+        if (t > 0.001f && t < pk.t[i]) { pk.t[i] = t; pk.sphere[i] = id; }
+    }
+#endif
+}
+
+// Closest hits for a whole packet: frustum-culled BVH walk, lane kernel per surviving sphere,
+// then a per-ray pass over planes and meshes.
+void IntersectPacket(const Scene& scene, RayPacket& pk, long long& spheresTested) {
+    auto testSphere = [&](int id) {
+        const Sphere& s = scene.spheres[id];
+        if (pk.cullSphere(s.center, s.radius)) return;
+        PacketHitSphere(pk, s.center, s.radius * s.radius, id);
+        spheresTested++;
+    };
+    const BVH& bvh = scene.sphereBVH;
+    if (scene.accel == AccelType::BVH && !bvh.empty()) {
+        int stack[BVH::kStackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            const BVHNode& node = bvh.nodes[stack[--sp]];
+            if (pk.cullBox(node.box)) continue;
+            if (node.isLeaf()) {
+                for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) testSphere(bvh.primIdx[i]);
+            } else {
+                stack[sp++] = node.leftFirst + 1;
+                stack[sp++] = node.leftFirst;
+            }
+        }
+    } else {
+        for (int id = 0; id < static_cast<int>(scene.spheres.size()); ++id) testSphere(id);
+    }
+    for (int i = 0; i < RayPacket::kRays; ++i) {
+        int prim = scene.closestOther(pk.ray(i), pk.t[i], pk.subID[i]);
+        if (prim >= 0) pk.other[i] = prim;
+    }
+}
+
+// Fills rec for lane i of a packet after IntersectPacket
+void ResolvePacketHit(const Scene& scene, const RayPacket& pk, int i, HitRecord& rec) {
+    rec = HitRecord();
+    int prim = (pk.other[i] >= 0) ? pk.other[i] : pk.sphere[i];
+    if (prim < 0) return;
+    TraversalHit h;
+    h.t = pk.t[i];
+    h.primID = prim;
+    h.subID = pk.subID[i];
+    h.type = scene.primType(prim);
+    scene.resolveHit(pk.ray(i), h, rec);
+}
+
+struct PacketStats {
+    long long packets = 0;
+    long long spheresTested = 0; // sphere-vs-packet kernel invocations after frustum culling
+    void add(const PacketStats& o) { packets += o.packets; spheresTested += o.spheresTested; }
+};
+
+// Traces a pixel rectangle as packets; onPixel(x, y, ray, hit) is called for every pixel
+template<typename PixelFn>
+void TracePackets(const Scene& scene, const Camera& cam, const Tile& rect, PacketStats& stats, PixelFn&& onPixel) {
+    RayPacket pk;
+    for (int ty = rect.y0; ty < rect.y1; ty += RayPacket::kDim) {
+        for (int tx = rect.x0; tx < rect.x1; tx += RayPacket::kDim) {
+            pk.generate(cam, tx, ty, rect.x1, rect.y1);
+            IntersectPacket(scene, pk, stats.spheresTested);
+            stats.packets++;
+            for (int ly = 0; ly < pk.h; ++ly) {
+                for (int lx = 0; lx < pk.w; ++lx) {
+                    int i = ly * RayPacket::kDim + lx;
+                    HitRecord rec;
+                    ResolvePacketHit(scene, pk, i, rec);
+                    onPixel(tx + lx, ty + ly, pk.ray(i), rec);
+                }
+            }
+        }
+    }
+}
+
+// ---------------------- Screen-space sphere binning ----------------------
+// The ray tracer's counterpart of a rasterizer's binning pass: once per frame every sphere's
+// projected screen rectangle is binned into per-tile lists, and a primary ray tests only the list
+// of the tile it starts in, plus the planes, meshes, instances and shapes, which are not binned.
+// Lists are sorted by the camera depth of each sphere's near side; no hit can come before that
+// depth, so a ray stops at the first entry that starts behind its closest hit. Spheres reaching
+// behind the camera plane have no finite projection and are added to every list.
+struct ScreenBinStats {
+    long long rays = 0;
+    long long tests = 0; // sphere intersections run for those rays
+    void add(const ScreenBinStats& o) { rays += o.rays; tests += o.tests; }
+};
+
+class ScreenBins {
+public:
+    struct Entry { float depth; int id; };
+    int binSize = 32, nx = 0, ny = 0;
+    int unprojected = 0; // spheres crossing the camera plane
+    int offscreen = 0;   // spheres no primary ray can reach
+    int maxList = 0;
+    double buildMs = 0.0;
+
+    bool empty() const { return first.empty(); }
+    size_t refs() const { return entries.size(); }
+    int binCount() const { return nx * ny; }
+
+    void build(const Scene& scene, const Camera& cam, int tileSize) {
+        auto t0 = chrono::high_resolution_clock::now();
+        binSize = max(1, tileSize);
+        nx = (cam.W + binSize - 1) / binSize;
+        ny = (cam.H + binSize - 1) / binSize;
+        unprojected = offscreen = maxList = 0;
+        // Bin rectangle per sphere (x0 > x1 when off screen), then count, prefix-sum and fill
+        const int n = static_cast<int>(scene.spheres.size());
+        vector<int> rect(size_t(n) * 4);
+        vector<float> depth(n);
+        first.assign(size_t(nx) * ny + 1, 0);
+        for (int i = 0; i < n; ++i) {
+            int* r = &rect[size_t(i) * 4];
+            depth[i] = project(cam, scene.spheres[i], r);
+            if (r[0] > r[1] || r[2] > r[3]) { offscreen++; continue; }
+            if (depth[i] <= 0.0f) unprojected++;
+            for (int by = r[2]; by <= r[3]; ++by)
+                for (int bx = r[0]; bx <= r[1]; ++bx) first[by * nx + bx + 1]++;
+        }
+        for (int b = 0; b < nx * ny; ++b) {
+            maxList = max(maxList, first[b + 1]);
+            first[b + 1] += first[b];
+        }
+        entries.resize(first.back());
+        vector<int> fill(first.begin(), first.end() - 1);
+        for (int i = 0; i < n; ++i) {
+            const int* r = &rect[size_t(i) * 4];
+            if (r[0] > r[1] || r[2] > r[3]) continue;
+            for (int by = r[2]; by <= r[3]; ++by)
+                for (int bx = r[0]; bx <= r[1]; ++bx) entries[fill[by * nx + bx]++] = Entry{depth[i], i};
+        }
+        for (int b = 0; b < nx * ny; ++b)
+            sort(entries.begin() + first[b], entries.begin() + first[b + 1], [](const Entry& a, const Entry& e) { return a.depth < e.depth; });
+        buildMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count();
+    }
+
+    // Closest hit for the primary ray through pixel (x, y); fills rec like Scene::intersect
+    bool intersect(const Scene& scene, const Ray& ray, int x, int y, HitRecord& rec, ScreenBinStats& stats) const {
+        rec = HitRecord();
+        TraversalHit h;
+        int other = scene.closestOther(ray, h.t, h.subID);
+        h.primID = other;
+        int b = (y / binSize) * nx + x / binSize;
+        for (int k = first[b]; k < first[b + 1]; ++k) {
+            const Entry& e = entries[k];
+            if (e.depth >= h.t) break;
+            float t;
+            stats.tests++;
+            if (scene.spheres[e.id].intersect(ray, t) && t < h.t) { h.t = t; h.primID = e.id; }
+        }
+        stats.rays++;
+        if (h.primID < 0) return false;
+        h.type = scene.primType(h.primID);
+        scene.resolveHit(ray, h, rec);
+        return rec.hit;
+    }
+
+private:
+    vector<int> first; // nx*ny+1 offsets into entries, bins in row-major order
+    vector<Entry> entries;
+
+    // Range of tan(angle) over a circle of radius r at (c, z) seen from the origin, z > r.
+    // The tangent lines make angles alpha -+ beta with the z axis, both inside (-pi/2, pi/2).
+    static void tangentRange(float c, float z, float r, float& lo, float& hi) {
+        float alpha = atan2f(c, z), beta = asinf(r / sqrtf(c * c + z * z));
+        lo = tanf(alpha - beta);
+        hi = tanf(alpha + beta);
+    }
+
+    // Bin rectangle {x0, x1, y0, y1} covered by the sphere, padded by a pixel against rounding;
+    // returns the camera depth of its near side
+    float project(const Camera& cam, const Sphere& s, int* r) const {
+        Vec3f rel = s.center - cam.position;
+        float cx = dot(rel, cam.right), cy = dot(rel, cam.up), cz = dot(rel, cam.forward);
+        float nearDepth = cz - s.radius;
+        if (nearDepth <= 0.0f) {
+            if (cz < -s.radius) { r[0] = r[2] = 0; r[1] = r[3] = -1; } // entirely behind the camera
+            else { r[0] = r[2] = 0; r[1] = nx - 1; r[3] = ny - 1; }
+            return nearDepth;
+        }
+        float uLo, uHi, vLo, vHi;
+        tangentRange(cx, cz, s.radius, uLo, uHi);
+        tangentRange(cy, cz, s.radius, vLo, vHi);
+        // Inverse of Camera::direction: pixel coordinates (x + sx, y + sy) of the tangents
+        float sxScale = 0.5f * cam.W / (cam.tanHalfFov * cam.aspect), syScale = 0.5f * cam.H / cam.tanHalfFov;
+        float px0 = (uLo * sxScale + 0.5f * cam.W) - 1.0f, px1 = (uHi * sxScale + 0.5f * cam.W) + 1.0f;
+        float py0 = (0.5f * cam.H - vHi * syScale) - 1.0f, py1 = (0.5f * cam.H - vLo * syScale) + 1.0f;
+        if (px1 < 0.0f || py1 < 0.0f || px0 >= float(cam.W) || py0 >= float(cam.H)) { r[0] = r[2] = 0; r[1] = r[3] = -1; return nearDepth; }
+        r[0] = static_cast<int>(max(px0, 0.0f)) / binSize;
+        r[1] = static_cast<int>(min(px1, float(cam.W - 1))) / binSize;
+        r[2] = static_cast<int>(max(py0, 0.0f)) / binSize;
+        r[3] = static_cast<int>(min(py1, float(cam.H - 1))) / binSize;
+        return nearDepth;
+    }
+};
+
+// ---------------------- Wavefront pipeline ----------------------
+// Bump allocator for per-tile ray queues. reset() rewinds without freeing, so once a worker has
+// seen its largest tile every later queue comes out of memory it already owns.
+class Arena {
+public:
+    static const size_t kAlign = 64;
+    explicit Arena(size_t bytes = size_t(1) << 20) : blockSize(bytes) {}
+
+    // Uninitialized storage for n objects of a trivial type (no constructor to run)
+    template<typename T>
+    T* alloc(size_t n) {
+        static_assert(is_trivial<T>::value, "use make() for types with constructors");
+        return static_cast<T*>(allocBytes(n * sizeof(T)));
+    }
+    // n objects copy-constructed from init. reset() never runs destructors, so T must not need one.
+    template<typename T>
+    T* make(size_t n, const T& init = T()) {
+        static_assert(is_trivially_destructible<T>::value && alignof(T) <= kAlign, "Arena never destroys its objects");
+        T* p = static_cast<T*>(allocBytes(n * sizeof(T)));
+        uninitialized_fill_n(p, n, init);
+        return p;
+    }
+    void reset() { cur = 0; offset = 0; }
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto& b : blocks) total += b.size;
+        return total;
+    }
+
+private:
+    struct Block { unique_ptr<uint8_t[]> storage; uint8_t* base = nullptr; size_t size = 0; };
+    vector<Block> blocks;
+    size_t blockSize;
+    size_t cur = 0, offset = 0;
+
+    void* allocBytes(size_t size) {
+        size_t bytes = (size + kAlign - 1) & ~(kAlign - 1);
+        for (; cur < blocks.size(); ++cur, offset = 0) {
+            if (offset + bytes <= blocks[cur].size) {
+                uint8_t* p = blocks[cur].base + offset;
+                offset += bytes;
+                return p;
+            }
+        }
+        Block b;
+        b.size = max(blockSize, bytes);
+        b.storage.reset(new uint8_t[b.size + kAlign]);
+        b.base = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(b.storage.get()) + kAlign - 1) & ~uintptr_t(kAlign - 1));
+        blocks.push_back(move(b));
+        cur = blocks.size() - 1;
+        offset = bytes;
+        return blocks.back().base;
+    }
+};
+
+// SoA ray queue in arena memory. Directions are stored as passed to the Ray constructor, so a
+// queued ray rebuilds bit-identically to the one the depth-first path would trace.
+struct RayQueue {
+    float *ox, *oy, *oz, *dx, *dy, *dz, *tMax;
+    int* owner; // index of the primary ray / pixel slot that queued it
+    int count = 0;
+
+    RayQueue(Arena& arena, int capacity)
+        : ox(arena.alloc<float>(capacity)), oy(arena.alloc<float>(capacity)), oz(arena.alloc<float>(capacity)),
+          dx(arena.alloc<float>(capacity)), dy(arena.alloc<float>(capacity)), dz(arena.alloc<float>(capacity)),
+          tMax(arena.alloc<float>(capacity)), owner(arena.alloc<int>(capacity)) {}
+    void push(const Vec3f& o, const Vec3f& d, float t, int who) {
+        ox[count] = o.x; oy[count] = o.y; oz[count] = o.z;
+        dx[count] = d.x; dy[count] = d.y; dz[count] = d.z;
+        tMax[count] = t;
+        owner[count] = who;
+        ++count;
+    }
+    Ray ray(int i) const { return Ray(Vec3f(ox[i], oy[i], oz[i]), Vec3f(dx[i], dy[i], dz[i])); }
+};
+
+// ---------------------- Light-origin shadow frusta ----------------------
+// Every shadow ray of a point light ends at light.position, so a tile's batch for that light,
+// traced backwards, is a bundle sharing one origin (like a camera packet). The bundle's cone is
+// built once, primitives are culled against it once, and each surviving sphere is run against all
+// of the batch's rays kSimdWidth at a time. Traced backwards, a segment stops 0.001 short of the
+// shading point instead of starting there, so a few grazing rays can come out differently.
+struct ShadowFrustum {
+    Vec3f apex, axis; // light position; mean direction from it to the shading points
+    float halfAngle;  // covers every ray of the batch
+    float reach;      // longest ray
+
+    ShadowFrustum(const Vec3f& light, const RayQueue& q) : apex(light), reach(0.0f) {
+        Vec3f sum;
+        for (int k = 0; k < q.count; ++k) sum = sum - Vec3f(q.dx[k], q.dy[k], q.dz[k]);
+        axis = normalize(sum);
+        float cosHalf = 1.0f;
+        for (int k = 0; k < q.count; ++k) {
+            cosHalf = min(cosHalf, -(axis.x * q.dx[k] + axis.y * q.dy[k] + axis.z * q.dz[k]));
+            reach = max(reach, q.tMax[k]);
+        }
+        halfAngle = acosf(max(-1.0f, cosHalf - 1e-4f)); // margin for rounding of the per-ray directions
+    }
+
+    // True when the sphere cannot touch any ray of the batch
+    bool cullSphere(const Vec3f& center, float radius) const {
+        Vec3f v = center - apex;
+        float d = v.length();
+        if (d <= radius) return false;
+        if (d - radius > reach) return true;
+        // Outside the cone widened by the sphere's own angular radius?
+        float wide = halfAngle + asinf(radius / d);
+        return wide < float(M_PI) && dot(v, axis) < cosf(wide) * d;
+    }
+    bool cullBox(const AABB& b) const { return cullSphere(b.centroid(), (b.hi - b.lo).length() * 0.5f); }
+};
+
+// Any-hit of one sphere against every ray of a shadow batch traced backwards from the light,
+// marking blocked[k]. Follows PacketHitSphere with -d as the direction and tMax - 0.001 as the end.
+void FrustumHitSphere(const RayQueue& q, const Vec3f& light, const Vec3f& center, float r2, uint8_t* blocked) {
+    Vec3f oc = light - center;
+    float c = dot(oc, oc) - r2;
+    const int n = q.count;
+    int i = 0;
+#if defined(__AVX2__)
+    const int kW = 8;
+    typedef __m256 V;
+    auto set1 = [](float v) { return _mm256_set1_ps(v); };
+    auto load = [](const float* p) { return _mm256_loadu_ps(p); };
+    V ocx = set1(oc.x), ocy = set1(oc.y), ocz = set1(oc.z), vc = set1(c);
+    V minusTwo = set1(-2.0f), four = set1(4.0f), two = set1(2.0f), eps = set1(0.001f);
+    for (; i + kW <= n; i += kW) {
+        V dx = load(q.dx + i), dy = load(q.dy + i), dz = load(q.dz + i);
+        V a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        V b = _mm256_mul_ps(minusTwo, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz)));
+        V disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(four, a), vc));
+        V twoA = _mm256_mul_ps(two, a);
+        V real = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ);
+        V sq = _mm256_sqrt_ps(disc);
+        V negB = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+        V t0 = _mm256_div_ps(_mm256_sub_ps(negB, sq), twoA), t1 = _mm256_div_ps(_mm256_add_ps(negB, sq), twoA);
+        V t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, eps, _CMP_GT_OQ));
+        V end = _mm256_sub_ps(load(q.tMax + i), eps);
+        V hitV = _mm256_and_ps(_mm256_and_ps(real, _mm256_cmp_ps(t, eps, _CMP_GT_OQ)), _mm256_cmp_ps(t, end, _CMP_LT_OQ));
+        unsigned hit = static_cast<unsigned>(_mm256_movemask_ps(hitV));
+        for (int l = 0; hit; ++l, hit >>= 1) blocked[i + l] |= uint8_t(hit & 1u);
+    }
+#endif
+    // Scalar lanes (all of them without AVX2); branch-free so the compiler can vectorize it
+    for (; i < n; ++i) {
+        float a = q.dx[i]*q.dx[i] + q.dy[i]*q.dy[i] + q.dz[i]*q.dz[i];
+        float b = -2.0f * (oc.x*q.dx[i] + oc.y*q.dy[i] + oc.z*q.dz[i]);
+        float disc = b*b - 4*a*c;
+        float sq = sqrtf(max(disc, 0.0f));
+        float t0 = (-b - sq) / (2*a);
+        float t1 = (-b + sq) / (2*a);
+        float t = (t0 > 0.001f) ? t0 : t1;
+        blocked[i] |= uint8_t(disc >= 0 && t > 0.001f && t < q.tMax[i] - 0.001f);
+    }
+}
+
+struct FrustumStats {
+    long long batches = 0, rays = 0;
+    long long spheres = 0; // sphere-vs-batch kernel runs after culling
+    long long others = 0;  // planes, meshes, instances and shapes left for per-ray tests
+    void add(const FrustumStats& o) { batches += o.batches; rays += o.rays; spheres += o.spheres; others += o.others; }
+};
+
+// Occlusion for a batch of point light li's shadow rays (forward rays as queued by the wavefront
+// setup): blocked[k] is set for every ray k that does not reach the light
+void OccludeFromLight(const Scene& scene, const RayQueue& q, int li, uint8_t* blocked, FrustumStats& stats) {
+    const Vec3f light = scene.lights[li].position;
+    fill(blocked, blocked + q.count, uint8_t(0));
+    if (q.count == 0) return;
+    ShadowFrustum fr(light, q);
+    stats.batches++;
+    stats.rays += q.count;
+    auto testSphere = [&](int id) {
+        const Sphere& s = scene.spheres[id];
+        if (fr.cullSphere(s.center, s.radius)) return;
+        FrustumHitSphere(q, light, s.center, s.radius * s.radius, blocked);
+        stats.spheres++;
+    };
+    const BVH& bvh = scene.sphereBVH;
+    if (scene.accel == AccelType::BVH && !bvh.empty()) {
+        int stack[BVH::kStackSize];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            const BVHNode& node = bvh.nodes[stack[--sp]];
+            if (fr.cullBox(node.box)) continue;
+            if (node.isLeaf()) {
+                for (int i = node.leftFirst; i < node.leftFirst + node.count; ++i) testSphere(bvh.primIdx[i]);
+            } else {
+                stack[sp++] = node.leftFirst + 1;
+                stack[sp++] = node.leftFirst;
+            }
+        }
+    } else {
+        for (int id = 0; id < static_cast<int>(scene.spheres.size()); ++id) testSphere(id);
+    }
+
+    // Everything else is tested per ray, forwards, and only for rays still unblocked. A plane (or a
+    // quad or disk in it) with the light and all shading points on its front side (or all on its
+    // back side) cannot block.
+    auto sameSide = [&](const Vec3f& point, const Vec3f& normal) {
+        float dl = dot(light - point, normal);
+        bool same = true;
+        for (int k = 0; k < q.count && same; ++k) {
+            float dp = dot(Vec3f(q.ox[k], q.oy[k], q.oz[k]) - point, normal);
+            same = dl > 0.0f ? dp >= -Scene::kCullPad : dp <= Scene::kCullPad;
+        }
+        return same;
+    };
+    vector<int> others;
+    for (size_t i = 0; i < scene.planes.size(); ++i)
+        if (!sameSide(scene.planes[i].point, scene.planes[i].normal)) others.push_back(scene.planePrimID(static_cast<int>(i)));
+    for (size_t i = 0; i < scene.meshes.size(); ++i)
+        if (!fr.cullBox(scene.meshes[i].bounds())) others.push_back(scene.meshPrimID(static_cast<int>(i)));
+    for (size_t i = 0; i < scene.instances.size(); ++i)
+        if (!fr.cullBox(scene.instances[i].worldBounds)) others.push_back(scene.instancePrimID(static_cast<int>(i)));
+    for (size_t i = 0; i < scene.shapes.size(); ++i) {
+        const Shape& sh = scene.shapes[i];
+        if (fr.cullBox(sh.bounds()) || (sh.kind != ShapeKind::Box && sameSide(sh.center, sh.normal))) continue;
+        others.push_back(scene.shapePrimID(static_cast<int>(i)));
+    }
+    stats.others += others.size();
+    if (others.empty()) return;
+    for (int k = 0; k < q.count; ++k) {
+        if (blocked[k]) continue;
+        Ray r = q.ray(k);
+        for (int prim : others) {
+            if (scene.occludedBy(r, prim, 0.0f, q.tMax[k])) { blocked[k] = 1; break; }
+        }
+    }
+}
+
+// Hardware cache-miss counter for the calling thread (Linux perf events). valid() is false where
+// the platform or its permissions do not allow it, and read() then returns 0.
+class CacheMissCounter {
+public:
+    CacheMissCounter() {
+#if defined(__linux__)
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof attr;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+    ~CacheMissCounter() {
+#if defined(__linux__)
+        if (fd >= 0) close(fd);
+#endif
+    }
+    CacheMissCounter(const CacheMissCounter&) = delete;
+    CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+    bool valid() const { return fd >= 0; }
+    long long read() const {
+        long long v = 0;
+#if defined(__linux__)
+        if (fd >= 0 && ::read(fd, &v, sizeof v) != static_cast<ssize_t>(sizeof v)) v = 0;
+#endif
+        return v;
+    }
+
+private:
+    int fd = -1;
+};
+
+enum class RaySortMode { Off, Auto, On };
+
+// Reorders a queue by a 64-bit key: quantized direction (4 bits per axis) above the 30-bit Morton
+// code of the origin within the queue's bounds, so rays that start close together and point the
+// same way are traversed back to back.
+void SortRayQueue(RayQueue& q, Arena& arena) {
+    struct Key { uint64_t key; int idx; };
+    AABB box;
+    for (int i = 0; i < q.count; ++i) box.expand(Vec3f(q.ox[i], q.oy[i], q.oz[i]));
+    Vec3f ext = box.hi - box.lo;
+    Vec3f quant(ext.x > 0 ? 1023.0f / ext.x : 0.0f, ext.y > 0 ? 1023.0f / ext.y : 0.0f, ext.z > 0 ? 1023.0f / ext.z : 0.0f);
+    Key* keys = arena.alloc<Key>(q.count);
+    for (int i = 0; i < q.count; ++i) {
+        uint32_t dirCode = Morton3((q.dx[i] + 1.0f) * 7.5f, (q.dy[i] + 1.0f) * 7.5f, (q.dz[i] + 1.0f) * 7.5f) & 0xFFFu;
+        uint32_t posCode = Morton3((q.ox[i] - box.lo.x) * quant.x, (q.oy[i] - box.lo.y) * quant.y, (q.oz[i] - box.lo.z) * quant.z);
+        keys[i] = Key{(uint64_t(dirCode) << 30) | posCode, i};
+    }
+    sort(keys, keys + q.count, [](const Key& a, const Key& b) { return a.key < b.key || (a.key == b.key && a.idx < b.idx); });
+    RayQueue sorted(arena, q.count);
+    for (int i = 0; i < q.count; ++i) {
+        int k = keys[i].idx;
+        sorted.push(Vec3f(q.ox[k], q.oy[k], q.oz[k]), Vec3f(q.dx[k], q.dy[k], q.dz[k]), q.tMax[k], q.owner[k]);
+    }
+    q = sorted;
+}
+
+struct WavefrontStats {
+    enum Stage { Generate, Intersect, ShadowSetup, Occlusion, Shade, kStages };
+    long long items[kStages] = {};  // rays (or pixels, for Shade) processed by each stage
+    double seconds[kStages] = {};
+    size_t arenaBytes = 0;          // largest arena footprint of any worker
+    // Ray sorting of shadow queues
+    long long shadowBatches = 0, sortedBatches = 0, sortedRays = 0;
+    // Probe batches are traced in both orders (without the shadow cache) to measure the effect
+    long long probeRays = 0;
+    long long probeStepsUnsorted = 0, probeStepsSorted = 0;
+    long long probeMissesUnsorted = 0, probeMissesSorted = 0;
+    bool missesCounted = false;
+    FrustumStats frusta; // --light-frusta
+    void add(const WavefrontStats& o) {
+        for (int s = 0; s < kStages; ++s) { items[s] += o.items[s]; seconds[s] += o.seconds[s]; }
+        arenaBytes = max(arenaBytes, o.arenaBytes);
+        shadowBatches += o.shadowBatches; sortedBatches += o.sortedBatches; sortedRays += o.sortedRays;
+        probeRays += o.probeRays;
+        probeStepsUnsorted += o.probeStepsUnsorted; probeStepsSorted += o.probeStepsSorted;
+        probeMissesUnsorted += o.probeMissesUnsorted; probeMissesSorted += o.probeMissesSorted;
+        missesCounted = missesCounted || o.missesCounted;
+        frusta.add(o.frusta);
+    }
+    // Items per second of worker time spent in the stage
+    double rate(int s) const { return seconds[s] > 0.0 ? items[s] / seconds[s] : 0.0; }
+    static const char* name(int s) {
+        static const char* names[kStages] = {"generate", "intersect", "shadow setup", "occlusion", "shade"};
+        return names[s];
+    }
+};
+
+// Breadth-first version of the per-pixel loop for one tile: every stage runs over the whole tile's
+// queue before the next starts, so each kernel (camera, closest-hit, any-hit, shading) stays hot.
+//   generate -> intersect -> shadow setup (one queue per light) -> occlusion -> shade
+// Area lights queue kMinShadowSamples rays per pixel, then a second setup/occlusion round
+// queues the rest of kMaxShadowSamples for pixels whose first samples disagree. Results match
+// Scene::traceRay exactly, except with lightFrusta (see ShadowFrustum). onPixel(x, y, color, aov)
+// receives every pixel of the tile.
+// Shadow queues of at least kMinSortBatch rays are Morton-sorted before occlusion in
+// RaySortMode::Auto; smaller ones are left in pixel order, where the sort would not pay for itself.
+const int kMinSortBatch = 2048;
+const int kSortProbeInterval = 16; // every Nth sorted batch is also measured unsorted
+
+template<typename PixelFn>
+void TraceWavefront(const Scene& scene, const Camera& cam, const Tile& rect, int pass, AOVBuffers& aovs,
+                    ShadowRayStats* rayStats, ShadowCache* cache, SecondaryRays* secondary, Arena& arena, WavefrontStats& stats,
+                    RaySortMode sortMode, bool lightFrusta, PixelFn&& onPixel) {
+    using Clock = chrono::high_resolution_clock;
+    auto lap = [&stats](int stage, Clock::time_point& t) {
+        Clock::time_point now = Clock::now();
+        stats.seconds[stage] += chrono::duration<double>(now - t).count();
+        t = now;
+    };
+    arena.reset();
+    const int tw = rect.x1 - rect.x0;
+    const int n = tw * (rect.y1 - rect.y0);
+    const int numLights = static_cast<int>(scene.lights.size());
+    Clock::time_point t = Clock::now();
+
+    // Generate
+    RayQueue primary(arena, n);
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        for (int x = rect.x0; x < rect.x1; ++x) {
+            float sx = 0.5f, sy = 0.5f;
+            if (pass > 0) scene.sampler.get2D(x, y, uint32_t(pass), kDimPixel, sx, sy);
+            primary.push(cam.position, normalize(cam.direction(x, y, sx, sy)), numeric_limits<float>::max(),
+                         (y - rect.y0) * tw + (x - rect.x0));
+        }
+    }
+    stats.items[WavefrontStats::Generate] += n;
+    lap(WavefrontStats::Generate, t);
+
+    // Intersect: closest hits only, attributes resolved afterwards for the hits that remain
+    TraversalHit* hits = arena.make<TraversalHit>(n);
+    for (int i = 0; i < n; ++i) hits[i] = scene.closestHit(primary.ray(i));
+    HitRecord* recs = arena.make<HitRecord>(n);
+    for (int i = 0; i < n; ++i) {
+        if (hits[i].primID >= 0) scene.resolveHit(primary.ray(i), hits[i], recs[i]);
+    }
+    if (cache && cache->tileCull) scene.beginTileCull(*cache, recs, n);
+    stats.items[WavefrontStats::Intersect] += n;
+    lap(WavefrontStats::Intersect, t);
+
+    // Per pixel and light: shadow rays queued and how many of them reached the light
+    size_t perLight = scene.useLightTree ? 0 : size_t(n) * numLights;
+    int* shadowRays = arena.alloc<int>(max(perLight, size_t(1)));
+    int* shadowLit = arena.alloc<int>(max(perLight, size_t(1)));
+    fill(shadowRays, shadowRays + perLight, 0);
+    fill(shadowLit, shadowLit + perLight, 0);
+    // Closed-form visibility where Scene::analyticVisibility applies, -1 where rays were queued
+    float* analytic = scene.analyticShadows && perLight ? arena.alloc<float>(perLight) : nullptr;
+    if (analytic) fill(analytic, analytic + perLight, -1.0f);
+    const int maxRays = Scene::kMaxShadowSamples;
+
+    // Counts a non-empty shadow queue and Morton-sorts it when sortMode asks for it
+    auto setupDone = [&](RayQueue& shadow) {
+        stats.shadowBatches++;
+        bool sortBatch = sortMode == RaySortMode::On || (sortMode == RaySortMode::Auto && shadow.count >= kMinSortBatch);
+        if (sortBatch) {
+            bool probe = stats.sortedBatches % kSortProbeInterval == 0;
+            if (probe) {
+                lap(WavefrontStats::ShadowSetup, t);
+                static thread_local CacheMissCounter misses;
+                auto measure = [&](long long& steps, long long& missCount) {
+                    long long s0 = tlsTraversalSteps, m0 = misses.read();
+                    for (int k = 0; k < shadow.count; ++k) scene.occluded(shadow.ray(k), 0.0f, shadow.tMax[k]);
+                    steps += tlsTraversalSteps - s0;
+                    missCount += misses.read() - m0;
+                };
+                measure(stats.probeStepsUnsorted, stats.probeMissesUnsorted);
+                SortRayQueue(shadow, arena);
+                measure(stats.probeStepsSorted, stats.probeMissesSorted);
+                stats.probeRays += shadow.count;
+                stats.missesCounted = misses.valid();
+                t = Clock::now(); // the probe traces are not part of any stage's time
+            } else {
+                SortRayQueue(shadow, arena);
+            }
+            stats.sortedBatches++;
+            stats.sortedRays += shadow.count;
+        }
+        stats.items[WavefrontStats::ShadowSetup] += shadow.count;
+        lap(WavefrontStats::ShadowSetup, t);
+    };
+
+    // Light tree: one queue holding a ray for every light each pixel picked
+    const int maxPicks = LightTree::kMaxSamples;
+    LightSample* picks = nullptr;
+    int* pickCount = nullptr;
+    uint8_t* pickLit = nullptr;
+    if (scene.useLightTree) {
+        picks = arena.alloc<LightSample>(size_t(n) * maxPicks);
+        pickCount = arena.alloc<int>(n);
+        pickLit = arena.alloc<uint8_t>(size_t(n) * maxPicks);
+        int total = 0;
+        for (int i = 0; i < n; ++i) {
+            int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+            pickCount[i] = recs[i].hit ? scene.selectLights(recs[i], x, y, pass, picks + size_t(i) * maxPicks, rayStats ? &rayStats->tree : nullptr) : 0;
+            total += pickCount[i];
+        }
+        RayQueue shadow(arena, total);
+        for (int i = 0; i < n; ++i) {
+            int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+            for (int k = 0; k < pickCount[i]; ++k) {
+                int slot = i * maxPicks + k;
+                Vec3f target = scene.selectedLightTarget(recs[i].point, picks[slot].light, x, y, pass);
+                Vec3f o, d;
+                float dist;
+                Scene::ShadowSegment(recs[i].point, target, o, d, dist);
+                shadow.push(o, d, dist, slot);
+                pickLit[slot] = 0;
+            }
+        }
+        if (shadow.count > 0) {
+            setupDone(shadow);
+            for (int k = 0; k < shadow.count; ++k) {
+                int slot = shadow.owner[k];
+                pickLit[slot] = scene.occludedCached(shadow.ray(k), shadow.tMax[k], cache, picks[slot].light) ? 0 : 1;
+            }
+            stats.items[WavefrontStats::Occlusion] += shadow.count;
+            lap(WavefrontStats::Occlusion, t);
+        }
+    } else {
+        for (int li = 0; li < numLights; ++li) {
+            const Light& light = scene.lights[li];
+            // Round 0 queues the first samples; round 1 (area lights only) the penumbra refinement
+            for (int round = 0; round < (light.isArea() ? 2 : 1); ++round) {
+                int capacity = 0;
+                if (round == 0) {
+                    capacity = n * (light.isArea() ? Scene::kMinShadowSamples : 1);
+                } else {
+                    for (int i = 0; i < n; ++i) {
+                        int queued = shadowRays[size_t(i) * numLights + li], lit = shadowLit[size_t(i) * numLights + li];
+                        if (queued != 0 && lit != 0 && lit != queued) capacity += maxRays - queued;
+                    }
+                }
+                RayQueue shadow(arena, capacity);
+                for (int i = 0; i < n; ++i) {
+                    if (!recs[i].hit || light.attenuation(recs[i].point) <= 0.0f) continue;
+                    int& queued = shadowRays[size_t(i) * numLights + li];
+                    int lit = shadowLit[size_t(i) * numLights + li];
+                    int first, last;
+                    if (round == 0 && analytic && light.isArea() &&
+                        scene.analyticVisibility(recs[i].point, li, analytic[size_t(i) * numLights + li], rayStats)) {
+                        queued = shadowLit[size_t(i) * numLights + li] = 1; // one query, no refinement round
+                        continue;
+                    }
+                    if (!light.isArea()) { first = 0; last = 1; }
+                    else if (round == 0) { first = 0; last = Scene::kMinShadowSamples; }
+                    else if (lit != 0 && lit != queued) { first = queued; last = maxRays; }
+                    else continue;
+                    int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+                    Sampler::Stream stream = scene.sampler.stream(x, y, SampleDimLight(li));
+                    for (int k = first; k < last; ++k) {
+                        Vec3f target = light.isArea() ? scene.lightSamplePoint(stream, recs[i].point, li, pass, k) : light.position;
+                        Vec3f o, d;
+                        float dist;
+                        Scene::ShadowSegment(recs[i].point, target, o, d, dist);
+                        shadow.push(o, d, dist, i);
+                    }
+                    queued = last;
+                }
+                if (shadow.count == 0) continue;
+                setupDone(shadow);
+
+                if (lightFrusta && !light.isArea()) {
+                    uint8_t* blocked = arena.alloc<uint8_t>(shadow.count);
+                    OccludeFromLight(scene, shadow, li, blocked, stats.frusta);
+                    for (int k = 0; k < shadow.count; ++k)
+                        if (!blocked[k]) shadowLit[size_t(shadow.owner[k]) * numLights + li]++;
+                } else {
+                    for (int k = 0; k < shadow.count; ++k) {
+                        if (!scene.occludedCached(shadow.ray(k), shadow.tMax[k], cache, li))
+                            shadowLit[size_t(shadow.owner[k]) * numLights + li]++;
+                    }
+                }
+                stats.items[WavefrontStats::Occlusion] += shadow.count;
+                lap(WavefrontStats::Occlusion, t);
+            }
+        }
+    }
+
+    // Shade
+    for (int i = 0; i < n; ++i) {
+        int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+        AOVSample aov = aovs.sampleFor(x, y, pass);
+        aov.rayStats = rayStats;
+        aov.secondary = secondary;
+        const HitRecord& rec = recs[i];
+        Ray r = primary.ray(i);
+        ColorF c;
+        if (!rec.hit) {
+            c = scene.shade(r, rec, &aov, cache); // background and AOV defaults, no rays
+        } else {
+            if (secondary) secondary->beginPixel(scene.maxDepth);
+            aov.depth = rec.t;
+            aov.normal = rec.normal;
+            aov.primID = rec.primID;
+            if (rayStats) rayStats->pixels++;
+            c = scene.ambient(rec);
+            if (scene.useLightTree) {
+                ColorF direct;
+                for (int k = 0; k < pickCount[i]; ++k) {
+                    int slot = i * maxPicks + k, li = picks[slot].light;
+                    if (rayStats) rayStats->rays[li]++;
+                    Scene::recordVisibility(&aov, li, pickLit[slot]);
+                    if (pickLit[slot]) direct = direct + scene.lightContribution(r, rec, li, picks[slot].weight);
+                }
+                c = c + direct;
+            }
+            else for (int li = 0; li < numLights; ++li) {
+                int queued = shadowRays[size_t(i) * numLights + li];
+                if (queued == 0) continue; // light out of range or outside its spot cone
+                float visible = float(shadowLit[size_t(i) * numLights + li]) / queued;
+                if (analytic && analytic[size_t(i) * numLights + li] >= 0.0f) visible = analytic[size_t(i) * numLights + li];
+                if (rayStats) rayStats->rays[li] += queued;
+                Scene::recordVisibility(&aov, li, visible);
+                if (visible > 0.0f) c = c + scene.lightContribution(r, rec, li, visible);
+            }
+            // Reflection and refraction are traced depth-first from here; they are rare next to shadow rays
+            const Material& mat = scene.materials[rec.material];
+            if (mat.hasSecondary()) c = c * mat.localWeight() + scene.secondary(r, rec, secondary, cache, 0, 1.0f);
+        }
+        onPixel(x, y, c, aov);
+    }
+    stats.items[WavefrontStats::Shade] += n;
+    lap(WavefrontStats::Shade, t);
+    stats.arenaBytes = max(stats.arenaBytes, arena.capacity());
+}
+
+// Depth-first tile with --tile-cull: primary hits are traced into the arena first so the tile's
+// shadow culling box is known before any pixel is shaded, then shaded in scanline order
+template<typename PixelFn>
+void TraceTileCulled(const Scene& scene, const Camera& cam, const Tile& rect, int pass, AOVBuffers& aovs,
+                     ShadowRayStats* rayStats, ShadowCache& cache, SecondaryRays* secondary, Arena& arena, PixelFn&& onPixel) {
+    arena.reset();
+    const int tw = rect.x1 - rect.x0;
+    const int n = tw * (rect.y1 - rect.y0);
+    Ray* rays = arena.make<Ray>(n, Ray(cam.position, cam.forward));
+    HitRecord* recs = arena.make<HitRecord>(n);
+    for (int i = 0; i < n; ++i) {
+        int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+        float sx = 0.5f, sy = 0.5f;
+        if (pass > 0) scene.sampler.get2D(x, y, uint32_t(pass), kDimPixel, sx, sy);
+        rays[i] = cam.primaryRay(x, y, sx, sy);
+        scene.intersect(rays[i], recs[i]);
+    }
+    scene.beginTileCull(cache, recs, n);
+    for (int i = 0; i < n; ++i) {
+        int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+        AOVSample aov = aovs.sampleFor(x, y, pass);
+        aov.rayStats = rayStats;
+        aov.secondary = secondary;
+        onPixel(x, y, scene.shade(rays[i], recs[i], &aov, &cache), aov);
+    }
+}
+
+// ---------------------- Reservoir light sampling (ReSTIR) ----------------------
+// Resampled importance sampling of direct light (Bitterli et al. 2020). Every pixel draws a fixed
+// number of candidate lights, keeps one in a weighted reservoir in proportion to its unshadowed
+// contribution, optionally merges the reservoirs of similar neighbouring pixels, and traces a
+// single shadow ray to the survivor. Cost per pixel does not grow with the light count (beyond the
+// light tree's O(log n) descent when it supplies the candidates).
+struct ReservoirSettings {
+    int candidates = 8;  // lights drawn per pixel
+    int neighbors = 4;   // reservoirs merged from the same tile; 0 = no spatial reuse
+    int radius = 8;      // pixels
+};
+
+struct Reservoir {
+    int light = -1;
+    Vec3f target;      // point on the light the shadow ray goes to
+    float pHat = 0.0f; // target function of the kept sample at this pixel
+    float wSum = 0.0f;
+    int M = 0;         // candidates seen
+    float W = 0.0f;    // unbiased contribution weight, wSum / (M * pHat)
+
+    void update(int li, const Vec3f& pt, float w, float p, float u) {
+        wSum += w;
+        if (w > 0.0f && u * wSum < w) { light = li; target = pt; pHat = p; }
+    }
+    void finalize() { W = (light >= 0 && pHat > 0.0f && M > 0) ? wSum / (M * pHat) : 0.0f; }
+};
+
+// Target function: unshadowed luminance from light li at rec, with the specular lobe replaced by
+// its peak (no powf). It is nonzero wherever lightContribution is, which keeps the estimate unbiased.
+inline float ReservoirTarget(const Scene& scene, const HitRecord& rec, int li) {
+    const Light& light = scene.lights[li];
+    const Material& mat = scene.materials[rec.material];
+    float diff = dot(rec.normal, normalize(light.position - rec.point));
+    if (diff <= 0.0f) return 0.0f;
+    auto lum = [](const Color& c) { return (0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b) / 255.0f; };
+    return light.intensity * light.attenuation(rec.point) * diff * (mat.diffuse * lum(mat.color) + mat.specular * lum(light.color));
+}
+
+template<typename PixelFn>
+void TraceReSTIR(const Scene& scene, const Camera& cam, const Tile& rect, int pass, AOVBuffers& aovs,
+                 ShadowRayStats* rayStats, ShadowCache* cache, SecondaryRays* secondary, Arena& arena,
+                 const ReservoirSettings& settings, PixelFn&& onPixel) {
+    arena.reset();
+    const int tw = rect.x1 - rect.x0, th = rect.y1 - rect.y0;
+    const int n = tw * th;
+    const int numLights = static_cast<int>(scene.lights.size());
+    const uint32_t kTag = 0x52535452u; // Philox stream key for candidates; kTag + 1 for reuse
+
+    Ray* rays = arena.make<Ray>(n, Ray(cam.position, cam.forward));
+    HitRecord* recs = arena.make<HitRecord>(n);
+    for (int i = 0; i < n; ++i) {
+        int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+        float sx = 0.5f, sy = 0.5f;
+        if (pass > 0) scene.sampler.get2D(x, y, uint32_t(pass), kDimPixel, sx, sy);
+        rays[i] = cam.primaryRay(x, y, sx, sy);
+        scene.intersect(rays[i], recs[i]);
+    }
+    if (cache && cache->tileCull) scene.beginTileCull(*cache, recs, n);
+
+    // Candidates, each resampled by pHat times the inverse of its source pdf:
+    //  - no more lights than candidates: every light once (pdf 1, a single draw);
+    //  - light tree: each traversal yields up to kMaxSamples lights weighted by 1 / selection
+    //    probability, and counts as one draw, so range-limited lights are not wasted on;
+    //  - otherwise: uniform picks, pdf 1 / numLights.
+    const bool enumerate = numLights <= settings.candidates;
+    const bool useTree = !enumerate && scene.useLightTree;
+    const int draws = enumerate ? 1 : useTree ? max(1, settings.candidates / LightTree::kMaxSamples) : settings.candidates;
+    Reservoir* initial = arena.make<Reservoir>(n);
+    for (int i = 0; i < n; ++i) {
+        Reservoir r;
+        const HitRecord& rec = recs[i];
+        if (rec.hit && numLights > 0) {
+            uint32_t pixel = uint32_t(rect.y0 + i / tw) * 65536u + uint32_t(rect.x0 + i % tw);
+            r.M = draws;
+            auto candidate = [&](int li, float invPdf, const uint32_t* rnd) {
+                float p = ReservoirTarget(scene, rec, li);
+                if (p <= 0.0f) return;
+                r.update(li, scene.lights[li].samplePoint(rec.point, U32ToUnitFloat(rnd[1]), U32ToUnitFloat(rnd[2])), p * invPdf, p,
+                         U32ToUnitFloat(rnd[3]));
+            };
+            if (enumerate) {
+                for (int li = 0; li < numLights; ++li) {
+                    uint32_t rnd[4];
+                    Philox4x32::generate(pixel, uint32_t(pass), uint32_t(li), kTag, scene.sampler.seed, rnd);
+                    candidate(li, 1.0f, rnd);
+                }
+            } else {
+                const Material& mat = scene.materials[rec.material];
+                float diffuse = mat.diffuse * max(mat.color.r, max(mat.color.g, mat.color.b)) / 255.0f;
+                for (int k = 0; k < draws; ++k) {
+                    uint32_t rnd[4];
+                    Philox4x32::generate(pixel, uint32_t(pass), uint32_t(k), kTag, scene.sampler.seed, rnd);
+                    if (!useTree) {
+                        candidate(static_cast<int>((uint64_t(rnd[0]) * uint32_t(numLights)) >> 32), float(numLights), rnd);
+                        continue;
+                    }
+                    LightSample picks[LightTree::kMaxSamples];
+                    int count = scene.lightTree.select(rec.point, rec.normal, diffuse, mat.specular, U32ToUnitFloat(rnd[0]), picks,
+                                                       rayStats ? &rayStats->tree : nullptr);
+                    for (int j = 0; j < count; ++j) {
+                        uint32_t sub[4];
+                        Philox4x32::generate(pixel, uint32_t(pass), uint32_t(draws + k * LightTree::kMaxSamples + j), kTag,
+                                             scene.sampler.seed, sub);
+                        candidate(picks[j].light, picks[j].weight, sub);
+                    }
+                }
+            }
+        }
+        r.finalize();
+        initial[i] = r;
+    }
+
+    // Spatial reuse: merge neighbours whose surface is similar, re-weighting their sample by its
+    // target function here (biased, with 1/M normalization, as in the paper's fast variant).
+    // Pointless when every light was already a candidate.
+    Reservoir* merged = initial;
+    if (settings.neighbors > 0 && !enumerate) {
+        merged = arena.make<Reservoir>(n);
+        for (int i = 0; i < n; ++i) {
+            Reservoir r = initial[i];
+            const HitRecord& rec = recs[i];
+            if (rec.hit) {
+                uint32_t pixel = uint32_t(rect.y0 + i / tw) * 65536u + uint32_t(rect.x0 + i % tw);
+                Reservoir m;
+                m.M = r.M;
+                m.update(r.light, r.target, r.pHat * r.W * r.M, r.pHat, 0.0f);
+                for (int k = 0; k < settings.neighbors; ++k) {
+                    uint32_t rnd[4];
+                    Philox4x32::generate(pixel, uint32_t(pass), uint32_t(k), kTag + 1u, scene.sampler.seed, rnd);
+                    int nx = i % tw + static_cast<int>((U32ToUnitFloat(rnd[0]) * 2.0f - 1.0f) * settings.radius);
+                    int ny = i / tw + static_cast<int>((U32ToUnitFloat(rnd[1]) * 2.0f - 1.0f) * settings.radius);
+                    if (nx < 0 || ny < 0 || nx >= tw || ny >= th) continue;
+                    int j = ny * tw + nx;
+                    const Reservoir& q = initial[j];
+                    const HitRecord& other = recs[j];
+                    if (j == i || !other.hit || q.light < 0) continue;
+                    if (dot(other.normal, rec.normal) < 0.9f || fabsf(other.t - rec.t) > 0.1f * rec.t) continue;
+                    float p = ReservoirTarget(scene, rec, q.light);
+                    m.M += q.M;
+                    m.update(q.light, q.target, p * q.W * q.M, p, U32ToUnitFloat(rnd[2]));
+                }
+                m.finalize();
+                r = m;
+            }
+            merged[i] = r;
+        }
+    }
+
+    // One shadow ray per pixel, then shading
+    for (int i = 0; i < n; ++i) {
+        int x = rect.x0 + i % tw, y = rect.y0 + i / tw;
+        AOVSample aov = aovs.sampleFor(x, y, pass);
+        aov.rayStats = rayStats;
+        aov.secondary = secondary;
+        const HitRecord& rec = recs[i];
+        ColorF c;
+        if (!rec.hit) {
+            c = scene.shade(rays[i], rec, &aov, cache);
+        } else {
+            if (secondary) secondary->beginPixel(scene.maxDepth);
+            aov.depth = rec.t;
+            aov.normal = rec.normal;
+            aov.primID = rec.primID;
+            if (rayStats) rayStats->pixels++;
+            c = scene.ambient(rec);
+            const Reservoir& r = merged[i];
+            if (r.light >= 0 && r.W > 0.0f) {
+                if (rayStats) rayStats->rays[r.light]++;
+                bool visible = !scene.isInShadow(rec.point, r.target, cache, r.light);
+                Scene::recordVisibility(&aov, r.light, visible ? 1.0f : 0.0f);
+                if (visible) c = c + scene.lightContribution(rays[i], rec, r.light, r.W);
+            }
+            const Material& mat = scene.materials[rec.material];
+            if (mat.hasSecondary()) c = c * mat.localWeight() + scene.secondary(rays[i], rec, secondary, cache, 0, 1.0f);
+        }
+        onPixel(x, y, c, aov);
+    }
+}
+
+// ---------------------- Tiled parallel rendering ----------------------
+// Splits the image into tiles and deals them out in contiguous blocks to per-worker deques.
+// A worker pops from the back of its own deque; once that is empty it steals from the front
+// of the others. Every pixel is still computed by the same code as the serial loop, so the
+// output does not depend on the thread count.
+class TileScheduler {
+public:
+    TileScheduler(int width, int height, int tileSize, int numThreads) {
+        tileSize = max(1, tileSize);
+        for (int y = 0; y < height; y += tileSize)
+            for (int x = 0; x < width; x += tileSize)
+                tiles.push_back(Tile{x, y, min(x + tileSize, width), min(y + tileSize, height)});
+        if (numThreads <= 0) numThreads = static_cast<int>(thread::hardware_concurrency());
+        threads = max(1, min(numThreads, static_cast<int>(tiles.size())));
+    }
+    int threadCount() const { return threads; }
+    size_t tileCount() const { return tiles.size(); }
+
+    // fn(tile, worker) runs once per tile; worker is in [0, threadCount()) for per-thread state.
+    // With reportProgress, the thread finishing a tile that crosses a 10% step prints it.
+    template<typename TileFn>
+    void run(TileFn&& fn, bool reportProgress) {
+        queues.clear();
+        for (int w = 0; w < threads; ++w) queues.emplace_back(new WorkQueue());
+        for (size_t i = 0; i < tiles.size(); ++i) queues[i * threads / tiles.size()]->tiles.push_back(tiles[i]);
+        atomic<int> done(0);
+        const int total = static_cast<int>(tiles.size());
+        mutex printMutex;
+
+        auto worker = [&](int w) {
+            Tile t;
+            while (pop(w, t) || steal(w, t)) {
+                fn(t, w);
+                int d = ++done;
+                if (reportProgress && (d * 10 / total) != ((d - 1) * 10 / total)) {
+                    lock_guard<mutex> lock(printMutex);
+                    cout << "Progress: " << (d * 100 / total) << "%" << endl;
+                }
+            }
+        };
+        vector<thread> pool;
+        for (int w = 1; w < threads; ++w) pool.emplace_back(worker, w);
+        worker(0);
+        for (auto& th : pool) th.join();
+    }
+
+private:
+    struct WorkQueue { mutex m; deque<Tile> tiles; };
+    vector<Tile> tiles;
+    vector<unique_ptr<WorkQueue>> queues;
+    int threads = 1;
+
+    bool pop(int w, Tile& t) {
+        WorkQueue& q = *queues[w];
+        lock_guard<mutex> lock(q.m);
+        if (q.tiles.empty()) return false;
+        t = q.tiles.back();
+        q.tiles.pop_back();
+        return true;
+    }
+    bool steal(int w, Tile& t) {
+        for (int i = 1; i < threads; ++i) {
+            WorkQueue& q = *queues[(w + i) % threads];
+            lock_guard<mutex> lock(q.m);
+            if (q.tiles.empty()) continue;
+            t = q.tiles.front();
+            q.tiles.pop_front();
+            return true;
+        }
+        return false;
+    }
+};
+
+// RMSE (in 8-bit levels) of the accumulated image against an exhaustive-lighting reference after
+// 1, 2, 4, ... passes, with the render time spent up to each point
+struct ConvergenceReport {
+    Image reference;
+    double referenceMs = 0.0;
+    double excludedMs = 0.0; // spent in record(), to be left out of the render time
+    struct Point { int passes; double ms, rmse; };
+    vector<Point> points;
+
+    ConvergenceReport() : reference(0, 0) {}
+
+    // Renders the reference with every light evaluated (no light tree, no reservoirs), through the
+    // same sub-pixel offsets as the measured run so that only the lighting estimate differs
+    void renderReference(Scene& scene, const Camera& cam, int W, int H, int passes, TileScheduler& scheduler, ToneMap toneMap) {
+        bool tree = scene.useLightTree;
+        scene.useLightTree = false;
+        HDRBuffer hdr(W, H);
+        auto t0 = chrono::high_resolution_clock::now();
+        for (int pass = 0; pass < passes; ++pass) {
+            scheduler.run([&](const Tile& tile, int) {
+                ShadowCache cache(scene.lights.size());
+                for (int y = tile.y0; y < tile.y1; ++y)
+                    for (int x = tile.x0; x < tile.x1; ++x) {
+                        float sx = 0.5f, sy = 0.5f;
+                        if (pass > 0) scene.sampler.get2D(x, y, uint32_t(pass), kDimPixel, sx, sy);
+                        hdr.add(x, y, scene.traceRay(cam.primaryRay(x, y, sx, sy), nullptr, &cache));
+                    }
+            }, false);
+            hdr.endPass();
+        }
+        referenceMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count();
+        reference = hdr.resolve(toneMap);
+        scene.useLightTree = tree;
+    }
+
+    bool wants(int passes) const { return (passes & (passes - 1)) == 0; }
+    void record(int passes, chrono::high_resolution_clock::time_point start, const HDRBuffer& hdr, ToneMap toneMap) {
+        auto t = chrono::high_resolution_clock::now();
+        double ms = chrono::duration<double, milli>(t - start).count() - excludedMs;
+        Image img = hdr.resolve(toneMap);
+        double sum = 0.0;
+        for (size_t i = 0; i < img.pix.size(); ++i) {
+            const Color& a = img.pix[i];
+            const Color& b = reference.pix[i];
+            double dr = a.r - b.r, dg = a.g - b.g, db = a.b - b.b;
+            sum += dr * dr + dg * dg + db * db;
+        }
+        points.push_back(Point{passes, ms, sqrt(sum / (3.0 * img.pix.size()))});
+        excludedMs += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t).count();
+    }
+};
+
+// Replaces every Sphere by the tessellated mesh the rasterizer draws for it, so both renderers
+// cast shadows from identical geometry
+void ConvertSpheresToMeshes(Scene& scene, int nLat, int nLon) {
+    for (const auto& s : scene.spheres) scene.meshes.push_back(MakeSphereMesh(s.radius, nLat, nLon, s.center, s.material));
+    scene.spheres.clear();
+}
+
+// Like ConvertSpheresToMeshes, but every sphere becomes an instance of one shared unit model,
+// so geometry memory stays that of a single mesh however many spheres the scene has
+void ConvertSpheresToInstances(Scene& scene, int nLat, int nLon) {
+    const float modelRadius = 0.5f;
+    auto model = scene.addModel(MakeSphereMesh(modelRadius, nLat, nLon, Vec3f(0, 0, 0), 0)); // instances set the material
+    for (const auto& s : scene.spheres)
+        scene.instances.push_back(MeshInstance(model, s.center, Vec3f(0, 0, 0), s.radius / modelRadius, s.material));
+    scene.spheres.clear();
+}
+
+// Replaces every axis-aligned plane with the quad it cuts out of room, which should hold all of it
+// that rays can reach; planes at an angle stay infinite
+void ConvertPlanesToQuads(Scene& scene, const AABB& room) {
+    Vec3f ext = room.hi - room.lo;
+    const Vec3f edges[3] = {Vec3f(ext.x, 0, 0), Vec3f(0, ext.y, 0), Vec3f(0, 0, ext.z)};
+    vector<Plane> kept;
+    for (const auto& pl : scene.planes) {
+        int a = -1;
+        for (int k = 0; k < 3; ++k) if (fabsf(pl.normal[k]) > 0.9999f) a = k;
+        if (a < 0) { kept.push_back(pl); continue; }
+        // Centered on the room, moved onto the plane along its axis; edges ordered to face its normal
+        Vec3f center = room.centroid() + normalize(edges[a]) * (pl.point[a] - room.centroid()[a]);
+        Vec3f eu = edges[(a + 1) % 3], ev = edges[(a + 2) % 3];
+        if (pl.normal[a] < 0.0f) swap(eu, ev);
+        scene.shapes.push_back(QuadShape(center, eu, ev, pl.material));
+    }
+    scene.planes = kept;
+}
+
+// Turns every point light into an area light of the given size at the same place. Rects are
+// size x size squares facing the scene origin.
+void ConvertLightsToArea(Scene& scene, LightShape shape, float size) {
+    for (auto& l : scene.lights) {
+        if (shape == LightShape::Sphere) {
+            l = SphereLight(l.position, size * 0.5f, l.color, l.intensity);
+        } else if (shape == LightShape::Rect) {
+            Vec3f n = normalize(-l.position);
+            Vec3f u = normalize(cross(fabsf(n.y) > 0.9f ? Vec3f(1, 0, 0) : Vec3f(0, 1, 0), n));
+            Vec3f v = cross(n, u);
+            l = RectLight(l.position, u * size, v * size, l.color, l.intensity);
+        }
+    }
+}
+
+// Gives every sphere and mesh (not the planes, so the shadows stay readable) a reflective or glass
+// variant of its material. Materials are copied, so planes that share one keep theirs.
+void ApplyGlossyMaterials(Scene& scene, float reflectivity, float transparency) {
+    map<MaterialID, MaterialID> glossy;
+    auto convert = [&](MaterialID id) {
+        auto it = glossy.find(id);
+        if (it != glossy.end()) return it->second;
+        Material m = scene.materials[id];
+        m.reflectivity = reflectivity;
+        m.transparency = transparency;
+        return glossy[id] = scene.addMaterial(m);
+    };
+    for (auto& s : scene.spheres) s.material = convert(s.material);
+    for (auto& m : scene.meshes) m.material = convert(m.material);
+    for (auto& inst : scene.instances) inst.material = convert(inst.material);
+}
+
+// Replaces the scene's lights with `count` small lights scattered over the geometry and the plane
+// anchors, each with a falloff range that overlaps about kLightsInRange others. Every third one is
+// a spot pointing down. Positions and colors are fixed by the seed.
+void ScatterLights(Scene& scene, int count, uint64_t seed) {
+    const float kLightsInRange = 24.0f;
+    AABB box;
+    for (const auto& sp : scene.spheres) box.expand(sp.bounds());
+    for (const auto& m : scene.meshes) for (const auto& v : m.vertices) box.expand(v);
+    for (const auto& inst : scene.instances) box.expand(inst.worldBounds);
+    for (const auto& pl : scene.planes) box.expand(pl.point);
+    for (const auto& sh : scene.shapes) box.expand(sh.center);
+    if (box.lo.x > box.hi.x) box = AABB(Vec3f(-1, -1, -1), Vec3f(1, 1, 1));
+    box = AABB(box.lo - Vec3f(1.0f, 0.5f, 1.0f), box.hi + Vec3f(1.0f, 3.0f, 1.0f));
+    Vec3f ext = box.hi - box.lo;
+    float volume = ext.x * ext.y * ext.z;
+    float range = cbrtf(kLightsInRange * volume / (count * (4.0f / 3.0f) * float(M_PI)));
+    // The falloff window averages about 0.23 over its sphere and the incidence cosine about 0.25
+    // over all directions; aim for roughly the brightness of one unattenuated light
+    float intensity = 1.0f / (kLightsInRange * 0.23f * 0.25f);
+
+    scene.lights.clear();
+    for (int i = 0; i < count; ++i) {
+        uint32_t r[4];
+        Philox4x32::generate(uint32_t(i), 0, 0x4C49u, 0, seed, r);
+        Vec3f p(box.lo.x + ext.x * U32ToUnitFloat(r[0]), box.lo.y + ext.y * U32ToUnitFloat(r[1]), box.lo.z + ext.z * U32ToUnitFloat(r[2]));
+        uint32_t c = HashU32(r[3]);
+        Color color(155 + (c & 0xff) % 101, 155 + ((c >> 8) & 0xff) % 101, 155 + ((c >> 16) & 0xff) % 101);
+        Light l(p, color, intensity);
+        l.range = range;
+        if (i % 3 == 2) {
+            l.axis = Vec3f(0, -1, 0);
+            l.cosCone = cosf(40.0f * float(M_PI) / 180.0f);
+            l.range = range * 1.5f;
+        }
+        scene.lights.push_back(l);
+    }
+}
+
+// Replaces the scene's spheres with count small ones scattered through a box around them, reusing
+// their materials in turn. Radii shrink with the count so the spheres fill about a tenth of the box.
+void ScatterSpheres(Scene& scene, int count, uint64_t seed) {
+    const float kFill = 0.1f;
+    AABB box;
+    vector<MaterialID> mats;
+    for (const auto& sp : scene.spheres) { box.expand(sp.bounds()); mats.push_back(sp.material); }
+    if (box.lo.x > box.hi.x) box = AABB(Vec3f(-1, 0, -1), Vec3f(1, 1, 1));
+    if (mats.empty()) mats.push_back(0);
+    box = AABB(box.lo - Vec3f(3.0f, 0.0f, 4.0f), box.hi + Vec3f(3.0f, 2.0f, 1.0f));
+    Vec3f ext = box.hi - box.lo;
+    float radius = cbrtf(kFill * ext.x * ext.y * ext.z / (count * (4.0f / 3.0f) * float(M_PI)));
+
+    scene.spheres.clear();
+    for (int i = 0; i < count; ++i) {
+        uint32_t r[4];
+        Philox4x32::generate(uint32_t(i), 0, 0x5350u, 0, seed, r);
+        Vec3f p(box.lo.x + ext.x * U32ToUnitFloat(r[0]), box.lo.y + ext.y * U32ToUnitFloat(r[1]), box.lo.z + ext.z * U32ToUnitFloat(r[2]));
+        scene.spheres.push_back(Sphere(p, radius * (0.5f + U32ToUnitFloat(r[3])), mats[i % mats.size()]));
+    }
+}
+
+enum class LightTreeMode { Off, Auto, On };
+const size_t kLightTreeMinLights = 128; // LightTreeMode::Auto builds the tree from this many lights
+
+// ---------------------- Command line ----------------------
+struct RenderOptions {
+    bool packets = false; // --packets: trace primary rays as 8x8 coherent packets
+    int threads = 0;      // --threads N: worker threads, 0 = all hardware threads
+    int tileSize = 32;    // --tile N: tile edge in pixels (multiples of 8 keep packets full)
+    bool saveAOVs = false; // --aovs: also save depth, normal, primitive-ID and per-light masks
+    bool shadowCache = true; // --no-shadow-cache: disable the per-tile last-occluder cache
+    AccelType accel = AccelType::BVH; // --accel none|bvh|grid
+    bool meshSpheres = false; // --mesh-spheres: trace spheres as the rasterizer's 20x40 UV-sphere meshes
+    bool instancedSpheres = false; // --instanced-spheres: same meshes, as instances of one shared model
+    bool lbvh = false; // --lbvh: build the sphere BVH with the parallel Morton builder
+    LightShape areaLights = LightShape::Point; // --area-lights sphere|rect: replace point lights
+    float lightSize = 0.5f; // --light-size S: sphere diameter / rect edge for --area-lights
+    SamplerType sampler = SamplerType::Sobol; // --sampler random|sobol|bluenoise
+    uint64_t seed = 0; // --seed N: sampler seed
+    bool wavefront = false; // --wavefront: trace tiles stage by stage over SoA ray queues
+    RaySortMode raySort = RaySortMode::Auto; // --ray-sort auto|on|off: Morton-sort wavefront shadow queues
+    int spp = 1;       // --spp N: accumulation passes; passes after the first jitter inside the pixel
+    ToneMap toneMap = ToneMap::Clamp; // --tonemap clamp|reinhard: applied once when encoding to 8 bits
+    float glossy = 0.0f; // --glossy R: mirror reflectivity for sphere/mesh materials
+    float glass = 0.0f;  // --glass T: transparency (refraction) for sphere/mesh materials
+    int maxDepth = 5;    // --max-depth N: reflection/refraction bounces
+    long long rayBudget = 0; // --ray-budget N: reflection/refraction rays per frame, 0 = unlimited
+    int manyLights = 0; // --many-lights N: replace the lights with N scattered ranged point/spot lights
+    LightTreeMode lightTree = LightTreeMode::Auto; // --light-tree auto|on|off
+    bool restir = false; // --restir: reservoir-resampled direct light, one shadow ray per pixel
+    ReservoirSettings reservoir; // --restir-candidates N, --restir-neighbors N
+    bool convergence = false; // --convergence: RMSE vs. time against an exhaustive-lighting reference
+    bool tileCull = false; // --tile-cull: per-tile shadow occluder lists from the tile's primary hit bounds
+    bool analyticShadows = false; // --analytic-shadows: closed-form sphere-light visibility behind sphere occluders
+    bool lightFrusta = false; // --light-frusta: wavefront point-light shadow batches traced as one bundle from the light
+    bool screenBins = false; // --screen-bins: primary rays test per-tile lists of projected spheres
+    int manySpheres = 0; // --many-spheres N: replace the spheres with N small scattered ones
+    bool boundedWalls = false; // --bounded-walls: walls as bounded quads in a BVH instead of infinite planes
+};
+
+RenderOptions ParseOptions(int argc, char** argv) {
+    RenderOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--packets") opts.packets = true;
+        else if (arg == "--threads" && i + 1 < argc) opts.threads = atoi(argv[++i]);
+        else if (arg == "--tile" && i + 1 < argc) opts.tileSize = atoi(argv[++i]);
+        else if (arg == "--aovs") opts.saveAOVs = true;
+        else if (arg == "--no-shadow-cache") opts.shadowCache = false;
+        else if (arg == "--mesh-spheres") opts.meshSpheres = true;
+        else if (arg == "--instanced-spheres") opts.instancedSpheres = true;
+        else if (arg == "--lbvh") opts.lbvh = true;
+        else if (arg == "--wavefront") opts.wavefront = true;
+        else if (arg == "--ray-sort" && i + 1 < argc) {
+            string v = argv[++i];
+            if (v == "auto") opts.raySort = RaySortMode::Auto;
+            else if (v == "on") opts.raySort = RaySortMode::On;
+            else if (v == "off") opts.raySort = RaySortMode::Off;
+            else cerr << "Unknown --ray-sort value: " << v << " (expected auto, on or off)" << endl;
+        }
+        else if (arg == "--spp" && i + 1 < argc) opts.spp = max(1, atoi(argv[++i]));
+        else if (arg == "--glossy" && i + 1 < argc) opts.glossy = min(max(float(atof(argv[++i])), 0.0f), 1.0f);
+        else if (arg == "--glass" && i + 1 < argc) opts.glass = min(max(float(atof(argv[++i])), 0.0f), 1.0f);
+        else if (arg == "--max-depth" && i + 1 < argc) opts.maxDepth = max(0, atoi(argv[++i]));
+        else if (arg == "--ray-budget" && i + 1 < argc) opts.rayBudget = max(0LL, atoll(argv[++i]));
+        else if (arg == "--restir") opts.restir = true;
+        else if (arg == "--restir-candidates" && i + 1 < argc) opts.reservoir.candidates = max(1, atoi(argv[++i]));
+        else if (arg == "--restir-neighbors" && i + 1 < argc) opts.reservoir.neighbors = max(0, atoi(argv[++i]));
+        else if (arg == "--convergence") opts.convergence = true;
+        else if (arg == "--tile-cull") opts.tileCull = true;
+        else if (arg == "--analytic-shadows") opts.analyticShadows = true;
+        else if (arg == "--light-frusta") opts.lightFrusta = opts.wavefront = true;
+        else if (arg == "--screen-bins") opts.screenBins = true;
+        else if (arg == "--bounded-walls") opts.boundedWalls = true;
+        else if (arg == "--many-spheres" && i + 1 < argc) opts.manySpheres = max(0, atoi(argv[++i]));
+        else if (arg == "--many-lights" && i + 1 < argc) opts.manyLights = max(0, atoi(argv[++i]));
+        else if (arg == "--light-tree" && i + 1 < argc) {
+            string v = argv[++i];
+            if (v == "auto") opts.lightTree = LightTreeMode::Auto;
+            else if (v == "on") opts.lightTree = LightTreeMode::On;
+            else if (v == "off") opts.lightTree = LightTreeMode::Off;
+            else cerr << "Unknown --light-tree value: " << v << " (expected auto, on or off)" << endl;
+        }
+        else if (arg == "--tonemap" && i + 1 < argc) {
+            string v = argv[++i];
+            if (v == "clamp") opts.toneMap = ToneMap::Clamp;
+            else if (v == "reinhard") opts.toneMap = ToneMap::Reinhard;
+            else cerr << "Unknown --tonemap value: " << v << " (expected clamp or reinhard)" << endl;
+        }
+        else if (arg == "--seed" && i + 1 < argc) opts.seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--sampler" && i + 1 < argc) {
+            string v = argv[++i];
+            if (v == "random") opts.sampler = SamplerType::Random;
+            else if (v == "sobol") opts.sampler = SamplerType::Sobol;
+            else if (v == "bluenoise") opts.sampler = SamplerType::BlueNoise;
+            else cerr << "Unknown --sampler value: " << v << " (expected random, sobol or bluenoise)" << endl;
+        }
+        else if (arg == "--light-size" && i + 1 < argc) opts.lightSize = static_cast<float>(atof(argv[++i]));
+        else if (arg == "--area-lights" && i + 1 < argc) {
+            string v = argv[++i];
+            if (v == "sphere") opts.areaLights = LightShape::Sphere;
+            else if (v == "rect") opts.areaLights = LightShape::Rect;
+            else cerr << "Unknown --area-lights value: " << v << " (expected sphere or rect)" << endl;
+        }
+        else if (arg == "--accel" && i + 1 < argc) {
+            string v = argv[++i];
+            if (v == "none") opts.accel = AccelType::None;
+            else if (v == "bvh") opts.accel = AccelType::BVH;
+            else if (v == "grid") opts.accel = AccelType::Grid;
+            else cerr << "Unknown --accel value: " << v << " (expected none, bvh or grid)" << endl;
+        }
+        else cerr << "Ignoring unknown option: " << arg << endl;
+    }
+    return opts;
+}
+
+// ---------------------- Simple evaluation (shadow pixel counting) ----------------------
+struct EvalMetrics {
+    double renderTimeMs = 0.0;
+    int shadowPixels = 0;
+    float shadowAreaRatio = 0.0f;
+};
+
+EvalMetrics EvaluateImage(const Image& img, float shadowThreshold = 0.30f) {
+    EvalMetrics m;
+    for (const auto& p : img.pix) {
+        if (p.brightness() < shadowThreshold) m.shadowPixels++;
+    }
+    m.shadowAreaRatio = static_cast<float>(m.shadowPixels) / (img.W * img.H);
+    return m;
+}
+
+// ---------------------- Scene setup (Case 1: three spheres, hard shadows) ----------------------
+void setupCase1(Scene& scene) {
+    // Materials
+    //Material floorMat(Color(200,200,200), 0.3f, 0.7f, 0.2f, 8.0f);
+    MaterialID sphereMat1 = scene.addMaterial(Material(Color(255,220,200), 0.2f, 0.8f, 0.3f, 32.0f));
+    MaterialID sphereMat2 = scene.addMaterial(Material(Color(200,220,255), 0.2f, 0.8f, 0.3f, 32.0f));
+    MaterialID sphereMat3 = scene.addMaterial(Material(Color(220,255,200), 0.2f, 0.8f, 0.3f, 32.0f));
+    //Material wallMat(Color(150,150,200), 0.4f, 0.6f, 0.2f, 8.0f);
+
+    // Planes: floor + back wall + left/right walls
+    scene.planes.clear();
+    //scene.planes.push_back(Plane(Vec3f(0, 0, 0), Vec3f(0, 1, 0), floorMat)); // floor
+    //scene.planes.push_back(Plane(Vec3f(0, 0, -5), Vec3f(0, 0, 1), wallMat)); // back wall
+    //scene.planes.push_back(Plane(Vec3f(-5, 0, 0), Vec3f(1, 0, 0), wallMat)); // left
+    //scene.planes.push_back(Plane(Vec3f(5, 0, 0), Vec3f(-1, 0, 0), wallMat)); // right
+    MaterialID sphereMat4 = scene.addMaterial(Material(Color(255,180,180), 0.2f, 0.8f, 0.3f, 32.0f));
+    MaterialID sphereMat5 = scene.addMaterial(Material(Color(180,255,180), 0.2f, 0.8f, 0.3f, 32.0f));
+    // Spheres: positions & radii match your original scene
+    scene.spheres.clear();
+    scene.spheres.push_back(Sphere(Vec3f(-1.5f, 1.0f, 1.5f), 0.5f, sphereMat1));
+    scene.spheres.push_back(Sphere(Vec3f(1.5f, 0.0f, 2.5f), 0.5f, sphereMat2));
+    scene.spheres.push_back(Sphere(Vec3f(0.0f, 0.5f, 2.0f), 0.5f, sphereMat3));
+    scene.spheres.push_back(Sphere(Vec3f(-0.8f, 2.3f, 1.5f), 0.5f, sphereMat4));
+    scene.spheres.push_back(Sphere(Vec3f(0.8f, 1.8f, 2.0f), 0.5f, sphereMat5));
+
+    // Light: brighter point light
+    scene.lights.clear();
+    scene.lights.push_back(Light(Vec3f(3.0f, 1.0f, 3.0f), Color(255,255,230), 1.0f));
+
+    // background
+    scene.background = Color(80,90,110);
+}
+
+// ---------------------- Main render ----------------------
+int main(int argc, char** argv) {
+    RenderOptions opts = ParseOptions(argc, argv);
+    const int W = 800;
+    const int H = 600;
+
+    cout << "=== RAY TRACER CASE 1: 3 SPHERES, HARD SHADOWS ===" << endl;
+    cout << "Image: " << W << " x " << H << endl;
+
+    Scene scene;
+    setupCase1(scene);
+    if (opts.manySpheres > 0) ScatterSpheres(scene, opts.manySpheres, opts.seed);
+    if (opts.meshSpheres) ConvertSpheresToMeshes(scene, 20, 40); // MakeSphere(0.5f, 20, 40) in the rasterizer
+    else if (opts.instancedSpheres) ConvertSpheresToInstances(scene, 20, 40);
+    // The walls' reachable extent: up to the neighbouring walls, and far past the frame vertically
+    if (opts.boundedWalls) ConvertPlanesToQuads(scene, AABB(Vec3f(-5, -20, -5), Vec3f(5, 20, 15)));
+    scene.useLBVH = opts.lbvh;
+    scene.buildThreads = opts.threads;
+    scene.sampler = Sampler(opts.sampler, opts.seed);
+    if (opts.manyLights > 0) ScatterLights(scene, opts.manyLights, opts.seed);
+    if (opts.areaLights != LightShape::Point) ConvertLightsToArea(scene, opts.areaLights, opts.lightSize);
+    if (opts.glossy > 0.0f || opts.glass > 0.0f) ApplyGlossyMaterials(scene, opts.glossy, opts.glass);
+    scene.maxDepth = opts.maxDepth;
+    scene.analyticShadows = opts.analyticShadows;
+
+    // Acceleration structure build is timed separately so build cost vs. traversal savings stay visible
+    auto tb0 = chrono::high_resolution_clock::now();
+    scene.buildAccel(opts.accel);
+    // Under --restir the tree supplies the reservoir candidates once lights outnumber them
+    bool treeByCount = scene.lights.size() >= kLightTreeMinLights || (opts.restir && scene.lights.size() > size_t(opts.reservoir.candidates));
+    if (opts.lightTree == LightTreeMode::On || (opts.lightTree == LightTreeMode::Auto && treeByCount))
+        scene.buildLightTree();
+    auto tb1 = chrono::high_resolution_clock::now();
+    double accelBuildMs = chrono::duration<double, milli>(tb1 - tb0).count();
+
+    HDRBuffer hdr(W, H);
+    AOVBuffers aovs(W, H, static_cast<int>(scene.lights.size()));
+
+    // Camera
+    Vec3f cameraPos(0, 3, 8);
+    Vec3f lookAt(0, 0.5f, 0);
+    Vec3f up(0, 1, 0);
+    float fov = 60.0f * M_PI / 180.0f;
+    Camera camera(cameraPos, lookAt, up, fov, W, H);
+    // Per-frame binning pass, rebuilt whenever the camera or the spheres move
+    ScreenBins bins;
+    if (opts.screenBins) bins.build(scene, camera, opts.tileSize);
+
+    PacketStats packetStats;
+    TileScheduler scheduler(W, H, opts.tileSize, opts.threads);
+    vector<PacketStats> workerPacketStats(scheduler.threadCount());
+    vector<ShadowCacheStats> workerCacheStats(scheduler.threadCount());
+    vector<ShadowRayStats> workerRayStats(scheduler.threadCount(), ShadowRayStats(scene.lights.size()));
+    vector<Arena> workerArenas(scheduler.threadCount());
+    vector<WavefrontStats> workerWaveStats(scheduler.threadCount());
+    vector<SecondaryRayStats> workerSecondaryStats(scheduler.threadCount());
+    vector<ScreenBinStats> workerBinStats(scheduler.threadCount());
+    ConvergenceReport convergence;
+    if (opts.convergence) convergence.renderReference(scene, camera, W, H, opts.spp, scheduler, opts.toneMap);
+    auto t0 = chrono::high_resolution_clock::now();
+
+    // Pass 0 traces pixel centers (as packets with --packets); later passes jitter inside the pixel
+    // and draw fresh shadow samples, all accumulated in float until the final resolve
+    for (int pass = 0; pass < opts.spp; ++pass) {
+        RayBudget rayBudget(opts.rayBudget, opts.spp);
+        scheduler.run([&](const Tile& tile, int worker) {
+            ShadowCache cache(scene.lights.size());
+            ShadowCache* cachePtr = (opts.shadowCache || opts.tileCull) ? &cache : nullptr;
+            cache.reuseOccluder = opts.shadowCache;
+            cache.tileCull = opts.tileCull;
+            SecondaryRays secondary(&rayBudget);
+            if (opts.restir) {
+                TraceReSTIR(scene, camera, tile, pass, aovs, &workerRayStats[worker], cachePtr, &secondary, workerArenas[worker],
+                            opts.reservoir, [&](int x, int y, const ColorF& c, const AOVSample& aov) {
+                    hdr.add(x, y, c);
+                    if (pass == 0) aovs.store(x, y, aov);
+                });
+            } else if (opts.wavefront) {
+                TraceWavefront(scene, camera, tile, pass, aovs, &workerRayStats[worker], cachePtr, &secondary, workerArenas[worker], workerWaveStats[worker],
+                               opts.raySort, opts.lightFrusta, [&](int x, int y, const ColorF& c, const AOVSample& aov) {
+                    hdr.add(x, y, c);
+                    if (pass == 0) aovs.store(x, y, aov);
+                });
+            } else if (opts.packets && pass == 0) {
+                TracePackets(scene, camera, tile, workerPacketStats[worker], [&](int x, int y, const Ray& r, const HitRecord& hr) {
+                    AOVSample aov = aovs.sampleFor(x, y, pass);
+                    aov.rayStats = &workerRayStats[worker];
+                    aov.secondary = &secondary;
+                    hdr.add(x, y, scene.shade(r, hr, &aov, cachePtr));
+                    aovs.store(x, y, aov);
+                });
+            } else if (opts.tileCull) {
+                TraceTileCulled(scene, camera, tile, pass, aovs, &workerRayStats[worker], cache, &secondary, workerArenas[worker],
+                                [&](int x, int y, const ColorF& c, const AOVSample& aov) {
+                    hdr.add(x, y, c);
+                    if (pass == 0) aovs.store(x, y, aov);
+                });
+            } else {
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    for (int x = tile.x0; x < tile.x1; ++x) {
+                        float sx = 0.5f, sy = 0.5f;
+                        if (pass > 0) scene.sampler.get2D(x, y, uint32_t(pass), kDimPixel, sx, sy);
+                        Ray r = camera.primaryRay(x, y, sx, sy);
+
+                        // Trace: color plus shadow mask / visibility / depth / normal / ID in one pass
+                        AOVSample aov = aovs.sampleFor(x, y, pass);
+                        aov.rayStats = &workerRayStats[worker];
+                        aov.secondary = &secondary;
+                        if (opts.screenBins) {
+                            HitRecord rec;
+                            bins.intersect(scene, r, x, y, rec, workerBinStats[worker]);
+                            hdr.add(x, y, scene.shade(r, rec, &aov, cachePtr));
+                        } else {
+                            hdr.add(x, y, scene.traceRay(r, &aov, cachePtr));
+                        }
+                        if (pass == 0) aovs.store(x, y, aov);
+                    }
+                }
+            }
+            workerCacheStats[worker].add(cache.stats);
+            workerSecondaryStats[worker].add(secondary.stats);
+        }, pass == opts.spp - 1);
+        hdr.endPass();
+        if (opts.convergence && convergence.wants(pass + 1)) convergence.record(pass + 1, t0, hdr, opts.toneMap);
+    }
+
+    auto t1 = chrono::high_resolution_clock::now();
+    double renderMs = chrono::duration<double, milli>(t1 - t0).count() - convergence.excludedMs;
+    for (const auto& ps : workerPacketStats) packetStats.add(ps);
+    ShadowCacheStats cacheStats;
+    for (const auto& cs : workerCacheStats) cacheStats.add(cs);
+    ShadowRayStats rayStats(scene.lights.size());
+    for (const auto& rs : workerRayStats) rayStats.add(rs);
+    WavefrontStats waveStats;
+    for (const auto& ws : workerWaveStats) waveStats.add(ws);
+    SecondaryRayStats secondaryStats;
+    for (const auto& ss : workerSecondaryStats) secondaryStats.add(ss);
+    Image image = hdr.resolve(opts.toneMap); // the only 8-bit quantization
+
+    // Save outputs
+    Image shadowMask = aovs.shadowMask();
+    image.SavePPM("rtcase2.ppm");
+    shadowMask.SavePPM("rtcase2_shadowmask.ppm");
+    if (opts.saveAOVs) aovs.SaveExtra("rtcase2");
+
+    // Evaluate
+    EvalMetrics metrics = EvaluateImage(image, 0.30f);
+    metrics.renderTimeMs = renderMs;
+
+    cout << "\n=== SHADOW METRICS ===" << endl;
+    cout << "Shadow pixels (brightness < 0.3): " << metrics.shadowPixels << endl;
+    cout << "Shadow area ratio: " << (metrics.shadowAreaRatio * 100.0f) << " %" << endl;
+    cout << "Render time: " << metrics.renderTimeMs << " ms" << endl;
+    cout << "Accel build time: " << accelBuildMs << " ms (" << scene.accelSummary() << ")" << endl;
+    cout << "Threads: " << scheduler.threadCount() << ", tiles: " << scheduler.tileCount() << endl;
+    if (opts.shadowCache) {
+        cout << "Shadow cache: " << (cacheStats.hitRate() * 100.0) << " % of shadowed queries answered by the cached occluder ("
+             << cacheStats.hits << "/" << cacheStats.blocked << ", " << cacheStats.probes << " probes, " << cacheStats.queries << " queries)" << endl;
+    }
+    if (opts.tileCull) {
+        const ShadowCacheStats& cs = cacheStats;
+        double q = cs.queries ? double(cs.queries) : 1.0;
+        cout << "Tile culling: " << cs.emptyPairs << "/" << cs.cullPairs << " tile/light pairs with no potential occluder; "
+             << (cs.culledRays * 100.0 / q) << " % of shadow rays skipped, " << (cs.listedRays * 100.0 / q) << " % tested against lists of "
+             << (cs.listedRays ? double(cs.listTests) / cs.listedRays : 0.0) << " primitives" << endl;
+    }
+    cout << "Shadow rays per shaded pixel:";
+    if (scene.lights.size() <= size_t(AOVBuffers::kMaxLightMasks))
+        for (size_t li = 0; li < scene.lights.size(); ++li) cout << " light " << li << " " << rayStats.raysPerPixel(li);
+    else
+        cout << " " << rayStats.raysPerPixel() << " over " << scene.lights.size() << " lights";
+    cout << endl;
+    if (opts.saveAOVs) cout << "AOV check: " << aovs.maskMismatches() << " pixels where the per-light masks disagree with the shadow mask" << endl;
+    if (opts.analyticShadows) {
+        cout << "Analytic soft shadows: " << rayStats.analytic << " area-light queries in closed form, " << rayStats.analyticFallbacks
+             << " sampled (another primitive in the way, or not a sphere light)" << endl;
+    }
+    if (scene.useLightTree) {
+        const LightTreeStats& lt = rayStats.tree;
+        double q = lt.queries ? double(lt.queries) : 1.0;
+        cout << "Light tree: " << scene.lightTree.nodeCount() << " nodes over " << scene.lights.size() << " lights; per shading point "
+             << lt.selected / q << " lights shaded, " << lt.visited / q << " nodes visited, " << lt.pruned / q << " subtrees pruned" << endl;
+    }
+    if (opts.convergence) {
+        cout << "Convergence vs. exhaustive lighting (" << convergence.referenceMs << " ms for " << opts.spp << " passes):";
+        for (const auto& pt : convergence.points) cout << " " << pt.passes << " spp " << pt.ms << " ms RMSE " << pt.rmse << ";";
+        cout << endl;
+    }
+    if (secondaryStats.rays + secondaryStats.cutDepth + secondaryStats.cutRoulette + secondaryStats.cutBudget > 0) {
+        cout << "Reflection/refraction rays: " << secondaryStats.rays << " ("
+             << (secondaryStats.pixels ? double(secondaryStats.rays) / secondaryStats.pixels : 0.0) << " per sample";
+        if (opts.rayBudget > 0) cout << ", budget " << opts.rayBudget << " per frame";
+        cout << "); paths cut: " << secondaryStats.cutDepth << " at depth " << scene.maxDepth << ", "
+             << secondaryStats.cutRoulette << " by Russian roulette, " << secondaryStats.cutBudget << " by the budget" << endl;
+    }
+    if (opts.wavefront) {
+        cout << "Wavefront stages (per worker thread):";
+        for (int st = 0; st < WavefrontStats::kStages; ++st)
+            cout << (st ? ", " : " ") << WavefrontStats::name(st) << " " << waveStats.rate(st) / 1e6
+                 << (st == WavefrontStats::Shade ? " Mpixels/s" : " Mrays/s");
+        cout << "; arena " << waveStats.arenaBytes / 1024 << " KB per worker" << endl;
+        cout << "Ray sort: " << waveStats.sortedBatches << "/" << waveStats.shadowBatches << " shadow batches sorted ("
+             << waveStats.sortedRays << " rays)";
+        if (waveStats.probeRays > 0) {
+            double n = double(waveStats.probeRays);
+            cout << "; probe batches: traversal steps/ray " << waveStats.probeStepsUnsorted / n << " -> " << waveStats.probeStepsSorted / n;
+            if (waveStats.missesCounted)
+                cout << ", cache misses/ray " << waveStats.probeMissesUnsorted / n << " -> " << waveStats.probeMissesSorted / n;
+            else
+                cout << ", cache misses n/a (no perf counter access)";
+        }
+        cout << endl;
+    }
+    if (opts.lightFrusta) {
+        const FrustumStats& fs = waveStats.frusta;
+        double b = fs.batches ? double(fs.batches) : 1.0;
+        cout << "Light frusta: " << fs.batches << " point-light batches of " << fs.rays / b << " rays; per batch "
+             << fs.spheres / b << " of " << scene.spheres.size() << " spheres left after culling, " << fs.others / b
+             << " other primitives left for per-ray tests; occlusion " << waveStats.rate(WavefrontStats::Occlusion) / 1e6 << " Mrays/s" << endl;
+    }
+    if (opts.screenBins) {
+        ScreenBinStats bs;
+        for (const auto& b : workerBinStats) bs.add(b);
+        cout << "Screen bins: " << bins.binCount() << " tiles of " << bins.binSize << " px, " << bins.refs() << " sphere refs (longest list "
+             << bins.maxList << "), " << bins.unprojected << " spheres in every list, " << bins.offscreen << " off screen; built in " << bins.buildMs
+             << " ms; " << (bs.rays ? double(bs.tests) / bs.rays : 0.0) << " sphere tests per primary ray" << endl;
+    }
+    if (opts.packets) {
+        cout << "Packets: " << packetStats.packets << " (8x8), spheres tested per packet after frustum culling: "
+             << (packetStats.packets ? double(packetStats.spheresTested) / packetStats.packets : 0.0) << endl;
+    }
     cout << "Pixels per second: " << (W * H) / (metrics.renderTimeMs / 1000.0) << endl;
 
     return 0;